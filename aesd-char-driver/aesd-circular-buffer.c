@@ -11,12 +11,47 @@
 
 #ifdef __KERNEL__
 #include <linux/string.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#define aesd_circular_buffer_calloc(n, size) kvcalloc(n, size, GFP_KERNEL)
+#define aesd_circular_buffer_release(ptr) kvfree(ptr)
+#include "aesdchar_trace.h"
 #else
 #include <string.h>
+#include <stdlib.h>
+#define aesd_circular_buffer_calloc(n, size) calloc(n, size)
+#define aesd_circular_buffer_release(ptr) free(ptr)
+#define trace_aesd_entry_add(buffer, seq, offs, size) do { } while (0)
+#define trace_aesd_entry_evict(buffer, seq, offs, size) do { } while (0)
 #endif
 
 #include "aesd-circular-buffer.h"
 
+/**
+ * @return the location in the entry structure of the entry_number-th oldest entry
+ */
+static inline size_t aesd_circular_buffer_index(struct aesd_circular_buffer *buffer, size_t entry_number)
+{
+	size_t index = buffer->out_offs + entry_number;
+
+	return (index >= buffer->capacity) ? index - buffer->capacity : index;
+}
+
+/**
+ * @return the number of entries currently stored in @param buffer
+ */
+size_t aesd_circular_buffer_count(struct aesd_circular_buffer *buffer)
+{
+	if (buffer->capacity == 0){
+		return 0;
+	}
+	if (buffer->full){
+		return buffer->capacity;
+	}
+
+	return (buffer->in_offs + buffer->capacity - buffer->out_offs) % buffer->capacity;
+}
+
 /**
  * @param buffer the buffer to search for corresponding offset.  Any necessary locking must be performed by caller.
  * @param char_offset the position to search for in the buffer list, describing the zero referenced
@@ -26,24 +61,177 @@
  *      in aesd_buffer.
  * @return the struct aesd_buffer_entry structure representing the position described by char_offset, or
  * NULL if this position is not available in the buffer (not enough data is written).
+ * Binary search over the entry start offsets, O(log n) in the number of entries.
  */
 struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(struct aesd_circular_buffer *buffer,
             size_t char_offset, size_t *entry_offset_byte_rtn )
 {
-	int i, curr_offset = 0;
+	size_t lo = 0, hi = aesd_circular_buffer_count(buffer);
+	size_t base, index;
+
+	if (char_offset >= aesd_circular_buffer_size(buffer)){
+		return NULL;
+	}
+	base = buffer->entry_start[buffer->out_offs];
+
+	/* find the last entry starting at or before char_offset */
+	while (hi - lo > 1){
+		size_t mid = lo + (hi - lo) / 2;
+		index = aesd_circular_buffer_index(buffer, mid);
+
+		if (buffer->entry_start[index] - base <= char_offset){
+			lo = mid;
+		} else {
+			hi = mid;
+		}
+	}
+
+	/* an empty entry starts where the next one does, so it is never the last match */
+	index = aesd_circular_buffer_index(buffer, lo);
+	*entry_offset_byte_rtn = char_offset - (buffer->entry_start[index] - base);
+	return &buffer->entry[index];
+}
+
+/**
+ * @param buffer the buffer to read from.  Any necessary locking must be performed by caller.
+ * @param char_offset the position to read at, as for aesd_circular_buffer_find_entry_offset_for_fpos()
+ * @param max_len the most bytes the caller wants
+ * @param len_rtn location to store the number of bytes available at the returned pointer
+ * @return the stored bytes at char_offset, or NULL if this position is not available in the buffer.
+ * Entries laid out back to back in memory, as entries of a byte ring are, are returned as one span,
+ * so all of a ring reads in one span through its mirror.
+ */
+const char *aesd_circular_buffer_span_for_fpos(struct aesd_circular_buffer *buffer,
+            size_t char_offset, size_t max_len, size_t *len_rtn)
+{
+	size_t entry_offset, index, len;
+	struct aesd_buffer_entry *entry, *next;
+	const char *start, *end;
 
-	for (i = buffer->out_offs; i < AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED + buffer->out_offs; i++){
-		int curr_index = i % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+	entry = aesd_circular_buffer_find_entry_offset_for_fpos(buffer, char_offset, &entry_offset);
+	if (entry == NULL){
+		return NULL;
+	}
 
-		if ((char_offset - curr_offset) < buffer->entry[curr_index].size){
-			*entry_offset_byte_rtn = char_offset - curr_offset;
-			return &buffer->entry[curr_index];
+	start = entry->buffptr + entry_offset;
+	len = entry->size - entry_offset;
+	index = entry - buffer->entry;
+	while (len < max_len){
+		index = (index + 1 == buffer->capacity) ? 0 : index + 1;
+		if (index == buffer->in_offs){
+			break;
+		}
+		next = &buffer->entry[index];
+		end = entry->buffptr + entry->size;
+		if (buffer->ring != NULL && end >= buffer->ring + buffer->ring_size){
+			end -= buffer->ring_size;
 		}
+		if (next->buffptr != end){
+			break;
+		}
+		len += next->size;
+		entry = next;
+	}
+
+	*len_rtn = (len < max_len) ? len : max_len;
+	return start;
+}
+
+/**
+ * @return the number of bytes stored in @param buffer, the sum of all entry sizes.
+ * Any necessary locking must be performed by caller.
+ */
+size_t aesd_circular_buffer_size(struct aesd_circular_buffer *buffer)
+{
+	if (aesd_circular_buffer_count(buffer) == 0){
+		return 0;
+	}
+	return buffer->end_offs - buffer->entry_start[buffer->out_offs];
+}
+
+/**
+ * @param buffer the buffer holding the entry.  Any necessary locking must be performed by caller.
+ * @param entry_number zero referenced number of the entry, counting from the oldest one
+ * @param char_offset_rtn location to store the character index of the first byte of the entry
+ *      if all buffer strings were concatenated end to end
+ * @return the entry, or NULL if the buffer holds fewer than entry_number + 1 entries
+ */
+struct aesd_buffer_entry *aesd_circular_buffer_entry_at(struct aesd_circular_buffer *buffer,
+            size_t entry_number, size_t *char_offset_rtn)
+{
+	size_t index;
 
-		curr_offset += buffer->entry[curr_index].size;
+	if (entry_number >= aesd_circular_buffer_count(buffer)){
+		return NULL;
 	}
 
-    return NULL;
+	index = aesd_circular_buffer_index(buffer, entry_number);
+	*char_offset_rtn = buffer->entry_start[index] - buffer->entry_start[buffer->out_offs];
+	return &buffer->entry[index];
+}
+
+/**
+* Removes the oldest entry of @param buffer, which must not be empty.
+* @return the buffptr of the removed entry
+*/
+static const char *aesd_circular_buffer_evict(struct aesd_circular_buffer *buffer)
+{
+	struct aesd_buffer_entry *oldest = &buffer->entry[buffer->out_offs];
+	const char *retval = oldest->buffptr;
+
+	trace_aesd_entry_evict(buffer, buffer->added - aesd_circular_buffer_count(buffer),
+			buffer->entry_start[buffer->out_offs], oldest->size);
+	memset(oldest, 0, sizeof(*oldest));
+	buffer->out_offs = (buffer->out_offs + 1) % buffer->capacity;
+	buffer->full = false;
+
+	return retval;
+}
+
+/**
+* Evicts the oldest entry of @param buffer if adding an entry of @param size bytes would take it over
+* buffer->max_bytes. Call it until it returns NULL before aesd_circular_buffer_add_entry() to apply
+* the byte bound; an entry larger than max_bytes ends up alone in the buffer.
+* Any necessary locking must be handled by the caller
+* @return the buffptr of the evicted entry, for the caller to free, or NULL if the entry fits
+*/
+const char *aesd_circular_buffer_make_room(struct aesd_circular_buffer *buffer, size_t size)
+{
+	if (buffer->max_bytes == 0 || aesd_circular_buffer_count(buffer) == 0 ||
+		aesd_circular_buffer_size(buffer) + size <= buffer->max_bytes){
+		return NULL;
+	}
+
+	return aesd_circular_buffer_evict(buffer);
+}
+
+/**
+* Evicts the oldest entries of @param buffer until the ring has @param size free bytes after its newest
+* entry, where the next entry is written. Bytes already written there for the next entry are kept.
+* Any necessary locking must be handled by the caller
+* @return where the next entry starts, or NULL if size is larger than the ring
+*/
+char *aesd_circular_buffer_ring_reserve(struct aesd_circular_buffer *buffer, size_t size)
+{
+	if (buffer->ring == NULL || size > buffer->ring_size){
+		return NULL;
+	}
+
+	while (aesd_circular_buffer_size(buffer) + size > buffer->ring_size){
+		aesd_circular_buffer_evict(buffer);
+	}
+
+	return buffer->ring + buffer->ring_head;
+}
+
+/**
+* Moves the start of the next entry of @param buffer @param size bytes further in the ring, giving up
+* bytes written there that will never be part of an entry.
+* Any necessary locking must be handled by the caller
+*/
+void aesd_circular_buffer_ring_skip(struct aesd_circular_buffer *buffer, size_t size)
+{
+	buffer->ring_head = (buffer->ring_head + size) % buffer->ring_size;
 }
 
 /**
@@ -52,30 +240,104 @@ struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(struct
 * new start location.
 * Any necessary locking must be handled by the caller
 * Any memory referenced in @param add_entry must be allocated by and/or must have a lifetime managed by the caller.
+* @return the buffptr of the overwritten entry, for the caller to free, or NULL. A buffer that failed to
+* initialize keeps nothing and returns the buffptr of @param add_entry itself.
 */
 const char* aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer, const struct aesd_buffer_entry *add_entry)
 {
 	const char* retval = NULL;
 
+	if (buffer->capacity == 0){
+		return add_entry->buffptr;
+	}
+
 	if (buffer->full && (buffer->in_offs == buffer->out_offs)){
+		trace_aesd_entry_evict(buffer, buffer->added - buffer->capacity,
+				buffer->entry_start[buffer->out_offs], buffer->entry[buffer->out_offs].size);
 		retval = buffer->entry[buffer->out_offs].buffptr;
-		buffer->out_offs = (buffer->out_offs + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+		buffer->out_offs = (buffer->out_offs + 1) % buffer->capacity;
 	}
 
-	buffer->entry[buffer->in_offs++] = *add_entry;
-
-	if (buffer->in_offs == AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED){
-		buffer->full = true;
-		buffer->in_offs = 0;
+	trace_aesd_entry_add(buffer, buffer->added, buffer->end_offs, add_entry->size);
+	buffer->entry_start[buffer->in_offs] = buffer->end_offs;
+	buffer->end_offs += add_entry->size;
+	buffer->added++;
+	buffer->entry[buffer->in_offs] = *add_entry;
+	if (buffer->ring != NULL){
+		/* an entry starting in the mirror is kept at the same bytes in the ring itself */
+		if (add_entry->buffptr >= buffer->ring + buffer->ring_size){
+			buffer->entry[buffer->in_offs].buffptr -= buffer->ring_size;
+		}
+		buffer->ring_head = buffer->entry[buffer->in_offs].buffptr - buffer->ring;
+		aesd_circular_buffer_ring_skip(buffer, add_entry->size);
 	}
+	/* in_offs is never seen at capacity, even by readers validating with a sequence count */
+	buffer->in_offs = (buffer->in_offs + 1 == buffer->capacity) ? 0 : buffer->in_offs + 1;
+	/* out_offs is not always at 0 when in_offs wraps, aesd_circular_buffer_make_room() moves it */
+	buffer->full = (buffer->in_offs == buffer->out_offs);
 
 	return retval;
 }
 
 /**
-* Initializes the circular buffer described by @param buffer to an empty struct
+* Initializes the circular buffer described by @param buffer to an empty struct holding at most
+* @param capacity entries.
+* @return 0 on success, -1 if capacity is zero or the entry arrays could not be allocated
 */
-void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer)
+int aesd_circular_buffer_init_capacity(struct aesd_circular_buffer *buffer, size_t capacity)
 {
     memset(buffer,0,sizeof(struct aesd_circular_buffer));
+
+	if (capacity == 0){
+		return -1;
+	}
+
+	buffer->entry = aesd_circular_buffer_calloc(capacity, sizeof(struct aesd_buffer_entry));
+	buffer->entry_start = aesd_circular_buffer_calloc(capacity, sizeof(size_t));
+	if (buffer->entry == NULL || buffer->entry_start == NULL){
+		aesd_circular_buffer_free(buffer);
+		return -1;
+	}
+	buffer->capacity = capacity;
+
+	return 0;
+}
+
+/**
+* Initializes the circular buffer described by @param buffer to an empty struct holding at most
+* AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED entries. Capacity is left zero if allocation fails.
+*/
+void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer)
+{
+	aesd_circular_buffer_init_capacity(buffer, AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED);
+}
+
+/**
+* Frees the entry arrays of @param buffer, not the memory the entries point to.
+*/
+void aesd_circular_buffer_free(struct aesd_circular_buffer *buffer)
+{
+	aesd_circular_buffer_release(buffer->entry);
+	aesd_circular_buffer_release(buffer->entry_start);
+	memset(buffer,0,sizeof(struct aesd_circular_buffer));
+}
+
+/**
+* Makes @param buffer, initialized and still empty, store entries back to back in the byte ring
+* @param ring of @param ring_size bytes instead of separate allocations. The ring_size bytes following
+* ring must map the same memory as ring itself; the ring stays owned by the caller. Entries are then
+* added at the pointer aesd_circular_buffer_ring_reserve() returns and evicted entries need no freeing.
+* @return 0 on success, -1 if there is no ring
+*/
+int aesd_circular_buffer_init_ring(struct aesd_circular_buffer *buffer, char *ring, size_t ring_size)
+{
+	if (ring == NULL || ring_size == 0){
+		return -1;
+	}
+
+	buffer->ring = ring;
+	buffer->ring_size = ring_size;
+	buffer->ring_head = 0;
+
+	return 0;
 }
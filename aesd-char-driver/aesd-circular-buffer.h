@@ -16,6 +16,9 @@
 #include <stdbool.h>
 #endif
 
+/**
+ * Default number of entries, used by aesd_circular_buffer_init()
+ */
 #define AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED 10
 
 struct aesd_buffer_entry
@@ -35,20 +38,58 @@ struct aesd_circular_buffer
     /**
      * An array of pointers to memory allocated for the most recent write operations
      */
-    struct aesd_buffer_entry  entry[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+    struct aesd_buffer_entry *entry;
+    /**
+     * Number of elements of entry and entry_start, set at initialization
+     */
+    size_t capacity;
     /**
      * The current location in the entry structure where the next write should
      * be stored.
      */
-    uint8_t in_offs;
+    size_t in_offs;
     /**
      * The first location in the entry structure to read from
      */
-    uint8_t out_offs;
+    size_t out_offs;
     /**
      * set to true when the buffer entry structure is full
      */
     bool full;
+    /**
+     * Offset of each entry in the stream of all bytes ever added to the buffer.
+     * Offsets only grow, so they stay sorted from out_offs to the newest entry
+     * and the offset of an entry in the buffer is its start minus the start of
+     * the entry at out_offs.
+     */
+    size_t *entry_start;
+    /**
+     * Stream offset one past the newest entry
+     */
+    size_t end_offs;
+    /**
+     * Number of entries ever added, the sequence number the next entry gets
+     */
+    size_t added;
+    /**
+     * Most bytes the entries may hold together, enforced by aesd_circular_buffer_make_room().
+     * Zero leaves the buffer bounded by capacity only.
+     */
+    size_t max_bytes;
+    /**
+     * Byte ring the entries are packed into back to back, or NULL when every buffptr is a separate
+     * allocation owned by the caller. The ring_size bytes following the ring must map the same memory,
+     * so an entry running past the end of the ring, and the whole history, read linearly.
+     */
+    char *ring;
+    /**
+     * Number of bytes in ring
+     */
+    size_t ring_size;
+    /**
+     * Offset in ring where the next entry starts
+     */
+    size_t ring_head;
 };
 
 extern struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(struct aesd_circular_buffer *buffer,
@@ -58,14 +99,36 @@ const char* aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer,
 
 extern void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer);
 
+extern int aesd_circular_buffer_init_capacity(struct aesd_circular_buffer *buffer, size_t capacity);
+
+extern void aesd_circular_buffer_free(struct aesd_circular_buffer *buffer);
+
+extern int aesd_circular_buffer_init_ring(struct aesd_circular_buffer *buffer, char *ring, size_t ring_size);
+
+extern char *aesd_circular_buffer_ring_reserve(struct aesd_circular_buffer *buffer, size_t size);
+
+extern void aesd_circular_buffer_ring_skip(struct aesd_circular_buffer *buffer, size_t size);
+
+extern const char *aesd_circular_buffer_span_for_fpos(struct aesd_circular_buffer *buffer,
+            size_t char_offset, size_t max_len, size_t *len_rtn);
+
+extern size_t aesd_circular_buffer_size(struct aesd_circular_buffer *buffer);
+
+extern size_t aesd_circular_buffer_count(struct aesd_circular_buffer *buffer);
+
+extern const char *aesd_circular_buffer_make_room(struct aesd_circular_buffer *buffer, size_t size);
+
+extern struct aesd_buffer_entry *aesd_circular_buffer_entry_at(struct aesd_circular_buffer *buffer,
+            size_t entry_number, size_t *char_offset_rtn);
+
 /**
  * Create a for loop to iterate over each member of the circular buffer.
  * Useful when you've allocated memory for circular buffer entries and need to free it
  * @param entryptr is a struct aesd_buffer_entry* to set with the current entry
  * @param buffer is the struct aesd_buffer * describing the buffer
- * @param index is a uint8_t stack allocated value used by this macro for an index
+ * @param index is a size_t stack allocated value used by this macro for an index
  * Example usage:
- * uint8_t index;
+ * size_t index;
  * struct aesd_circular_buffer buffer;
  * struct aesd_buffer_entry *entry;
  * AESD_CIRCULAR_BUFFER_FOREACH(entry,&buffer,index) {
@@ -74,7 +137,7 @@ extern void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer);
  */
 #define AESD_CIRCULAR_BUFFER_FOREACH(entryptr,buffer,index) \
     for(index=0, entryptr=&((buffer)->entry[index]); \
-            index<AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; \
+            index<(buffer)->capacity; \
             index++, entryptr=&((buffer)->entry[index]))
 
 
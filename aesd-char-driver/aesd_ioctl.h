@@ -36,11 +36,154 @@ struct aesd_seekto {
 // Pick an arbitrary unused value from https://github.com/torvalds/linux/blob/master/Documentation/userspace-api/ioctl/ioctl-number.rst
 #define AESD_IOC_MAGIC 0x16
 
+/**
+ * Retention state of the device, read with AESDCHAR_IOCGUSAGE
+ */
+struct aesd_usage {
+    /**
+     * Number of writes currently kept
+     */
+    uint64_t entries;
+    /**
+     * Number of bytes held by those writes
+     */
+    uint64_t bytes;
+    /**
+     * Most writes kept, the max_entries module parameter
+     */
+    uint64_t max_entries;
+    /**
+     * Most bytes kept, the max_bytes module parameter, 0 when not bounded by bytes
+     */
+    uint64_t max_bytes;
+};
+
+/**
+ * Where a write kept by the device lies in the ring of a mapping of the device
+ */
+struct aesd_mmap_entry {
+    /**
+     * Offset of the write from the start of the ring
+     */
+    uint64_t offset;
+    /**
+     * Length of the write, which may run past the end of the ring into its second mapping
+     */
+    uint64_t size;
+};
+
+/**
+ * First page(s) of a read-only mmap of the device, followed at ring_offset by the ring of writes mapped
+ * twice in a row, so every write and the whole history read linearly. Only available when the device
+ * packs writes into a ring (ring_bytes module parameter).
+ *
+ * The writes kept are entry[out_offs] up to, not including, entry[in_offs] modulo capacity, all capacity
+ * of them when full is set. A reader copies what it needs between two reads of an even seq and retries
+ * if seq changed in between; seq is odd while the device is being written.
+ */
+struct aesd_mmap_header {
+    uint32_t seq;
+    uint32_t full;
+    uint64_t in_offs;
+    uint64_t out_offs;
+    uint64_t capacity;
+    uint64_t ring_offset;
+    uint64_t ring_size;
+    struct aesd_mmap_entry entry[];
+};
+
+/**
+ * A write kept by the device, as listed by AESDCHAR_IOCGINDEX
+ */
+struct aesd_index_entry {
+    /**
+     * Sequence number of the write, counting every write stored since the device was loaded,
+     * so it keeps naming the same write when older ones are evicted
+     */
+    uint64_t seq;
+    /**
+     * Offset of the write in the history as read from the device
+     */
+    uint64_t offset;
+    /**
+     * Length of the write
+     */
+    uint64_t size;
+};
+
+/**
+ * Argument of AESDCHAR_IOCGINDEX, which fills table with the writes kept, oldest first
+ */
+struct aesd_index {
+    /**
+     * User pointer to an array of struct aesd_index_entry
+     */
+    uint64_t table;
+    /**
+     * In: number of elements of table. Out: number of writes kept, which may exceed what was
+     * filled in when table is too small; a NULL table with no elements only queries the count
+     */
+    uint64_t entries;
+};
+
+/**
+ * Argument of AESDCHAR_IOCREADCMDS, which copies whole writes into buf in one call
+ */
+struct aesd_read_cmds {
+    /**
+     * Sequence number of the first write to copy, as reported in struct aesd_index_entry
+     */
+    uint64_t seq;
+    /**
+     * In: most writes to copy. Out: writes copied, only as many as fit whole in buf
+     */
+    uint64_t cmds;
+    /**
+     * User pointer to the destination
+     */
+    uint64_t buf;
+    /**
+     * In: size of buf. Out: bytes copied
+     */
+    uint64_t len;
+};
+
+/**
+ * Argument of AESDCHAR_IOCSEEKSTREAM. Stream offsets count every byte written since the device was
+ * loaded, so unlike file offsets, which count from the oldest byte kept, they keep naming the same
+ * byte when older writes are evicted.
+ */
+struct aesd_stream {
+    /**
+     * In: stream offset to move the file to, moved up to start if that byte was evicted and down to
+     * end past the history. Out: the stream offset the file was moved to
+     */
+    uint64_t offset;
+    /**
+     * Out: stream offset of the oldest byte kept
+     */
+    uint64_t start;
+    /**
+     * Out: stream offset just past the newest byte kept
+     */
+    uint64_t end;
+};
+
 // Define a write command from the user point of view, use command number 1
 #define AESDCHAR_IOCSEEKTO _IOWR(AESD_IOC_MAGIC, 1, struct aesd_seekto)
+// Read the retention state, command number 2
+#define AESDCHAR_IOCGUSAGE _IOR(AESD_IOC_MAGIC, 2, struct aesd_usage)
+// List every write kept with its sequence number, offset and size, command number 3
+#define AESDCHAR_IOCGINDEX _IOWR(AESD_IOC_MAGIC, 3, struct aesd_index)
+// Copy a range of writes, command number 4
+#define AESDCHAR_IOCREADCMDS _IOWR(AESD_IOC_MAGIC, 4, struct aesd_read_cmds)
+// Make reads of this open file at the end of the history wait for the next write (nonzero) or return end of file (0, the default), command number 5
+#define AESDCHAR_IOCSTAIL _IOW(AESD_IOC_MAGIC, 5, uint32_t)
+// Move the file to a stream offset, reads then continue from that byte however many writes are evicted, command number 6
+#define AESDCHAR_IOCSEEKSTREAM _IOWR(AESD_IOC_MAGIC, 6, struct aesd_stream)
 /**
  * The maximum number of commands supported, used for bounds checking
  */
-#define AESDCHAR_IOC_MAXNR 1
+#define AESDCHAR_IOC_MAXNR 6
 
 #endif /* AESD_IOCTL_H */
@@ -13,8 +13,9 @@
 #undef PDEBUG             /* undef it, just in case */
 #ifdef AESD_DEBUG
 #  ifdef __KERNEL__
-     /* This one if debugging is on, and kernel space */
-#    define PDEBUG(fmt, args...) printk( KERN_DEBUG "aesdchar: " fmt, ## args)
+     /* This one if debugging is on, and kernel space: a dynamic debug site, formatted only
+      * once enabled at run time through <debugfs>/dynamic_debug/control */
+#    define PDEBUG(fmt, args...) pr_debug("aesdchar: " fmt, ## args)
 #  else
      /* This one for user space */
 #    define PDEBUG(fmt, args...) fprintf(stderr, fmt, ## args)
@@ -25,16 +26,79 @@
 
 #include "aesd-circular-buffer.h"
 
+#define AESD_WRITE_MIN_ALLOC 64  /* first allocation for a command being written */
+
+#define AESD_LAT_BUCKETS 32  /* latency histogram buckets, the last one also counts anything slower */
+
+/**
+ * Counters of struct aesd_stats, named for debugfs by aesd_stat_names
+ */
+enum aesd_stat {
+	AESD_STAT_BYTES_WRITTEN,
+	AESD_STAT_ENTRIES_WRITTEN,
+	AESD_STAT_READS,
+	AESD_STAT_BYTES_READ,
+	AESD_STAT_EVICTIONS,
+	AESD_STAT_LOCK_WAIT_NS,
+	AESD_STAT_SEEKS,
+	AESD_NR_STATS
+};
+
+/**
+ * Activity of a device on one CPU, summed over all CPUs when read
+ */
+struct aesd_stats
+{
+	u64 count[AESD_NR_STATS];
+	u64 read_lat[AESD_LAT_BUCKETS];   /* reads taking [2^(n-1), 2^n) ns in bucket n */
+	u64 write_lat[AESD_LAT_BUCKETS];  /* same for writes */
+};
+
+/**
+ * A command being written, kept until its newline
+ */
+struct aesd_staging
+{
+	struct aesd_buffer_entry entry;
+	size_t alloc;    /* bytes allocated for entry, grown geometrically */
+	bool dropped;    /* the rest of the command is discarded */
+};
+
 struct aesd_dev
 {
     /**
      * TODO: Add structure(s) and locks needed to complete assignment requirements
      */
 	struct aesd_circular_buffer c_buffer;
-	struct aesd_buffer_entry c_buffer_entry;
-	struct mutex lock;
+	struct aesd_staging parked;    /* command left unfinished by a closed file, continued by the next write */
+	atomic_long_t staging_bytes;   /* allocated for the staging of open files and parked */
+	struct page **ring_pages;      /* pages of the byte ring, listed twice for its mirror */
+	size_t ring_npages;
+	struct aesd_mmap_header *mmap_header;  /* header page(s) of the read-only mapping */
+	size_t mmap_header_size;
+	struct mutex lock;             /* serializes writers */
+	seqcount_mutex_t seq;          /* bumped by writers around every change of c_buffer entries */
+	struct srcu_struct srcu;       /* held by lockless readers, evicted writes are freed after it */
+	wait_queue_head_t readq;       /* woken on every write added to the history */
+	struct aesd_stats __percpu *stats;
     struct cdev cdev;     /* Char device structure      */
 };
 
+/**
+ * An open file of a device, its private_data. Commands written in several
+ * pieces are staged per file, so writers of different files neither mix their
+ * commands nor hold the device lock while copying them in.
+ */
+struct aesd_file
+{
+	struct aesd_dev *dev;
+	struct aesd_staging staging;
+	struct mutex lock;             /* serializes writes through this file */
+	spinlock_t pos_lock;           /* pairs pos with anchor for readers sharing the file */
+	loff_t pos;                    /* file offset the last read of it left, -1 once moved otherwise */
+	size_t anchor;                 /* stream offset that offset counts from */
+	bool tail;                     /* reads at the end of the history wait, set with AESDCHAR_IOCSTAIL */
+};
+
 
 #endif /* AESD_CHAR_DRIVER_AESDCHAR_H_ */
@@ -0,0 +1,200 @@
+/*
+ * aesdchar_trace.h
+ *
+ * Tracepoints of the aesdchar driver, under events/aesdchar in tracefs.
+ * Each operation is traced on entry and exit, locks on acquire and release
+ * and history entries when added and evicted, so perf or trace-cmd can break
+ * the latency of an operation down. Disabled tracepoints cost a patched out
+ * branch only.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM aesdchar
+
+#if !defined(AESD_CHAR_DRIVER_AESDCHAR_TRACE_H_) || defined(TRACE_HEADER_MULTI_READ)
+#define AESD_CHAR_DRIVER_AESDCHAR_TRACE_H_
+
+#include <linux/tracepoint.h>
+#include "aesd-circular-buffer.h"
+
+DECLARE_EVENT_CLASS(aesd_io_enter,
+	TP_PROTO(unsigned int minor, loff_t pos, size_t count),
+	TP_ARGS(minor, pos, count),
+	TP_STRUCT__entry(
+		__field(unsigned int, minor)
+		__field(loff_t, pos)
+		__field(size_t, count)
+	),
+	TP_fast_assign(
+		__entry->minor = minor;
+		__entry->pos = pos;
+		__entry->count = count;
+	),
+	TP_printk("minor=%u pos=%lld count=%zu", __entry->minor, __entry->pos, __entry->count)
+);
+
+DEFINE_EVENT(aesd_io_enter, aesd_read_enter,
+	TP_PROTO(unsigned int minor, loff_t pos, size_t count),
+	TP_ARGS(minor, pos, count));
+
+DEFINE_EVENT(aesd_io_enter, aesd_write_enter,
+	TP_PROTO(unsigned int minor, loff_t pos, size_t count),
+	TP_ARGS(minor, pos, count));
+
+DECLARE_EVENT_CLASS(aesd_io_exit,
+	TP_PROTO(unsigned int minor, loff_t pos, ssize_t ret),
+	TP_ARGS(minor, pos, ret),
+	TP_STRUCT__entry(
+		__field(unsigned int, minor)
+		__field(loff_t, pos)
+		__field(ssize_t, ret)
+	),
+	TP_fast_assign(
+		__entry->minor = minor;
+		__entry->pos = pos;
+		__entry->ret = ret;
+	),
+	TP_printk("minor=%u pos=%lld ret=%zd", __entry->minor, __entry->pos, __entry->ret)
+);
+
+DEFINE_EVENT(aesd_io_exit, aesd_read_exit,
+	TP_PROTO(unsigned int minor, loff_t pos, ssize_t ret),
+	TP_ARGS(minor, pos, ret));
+
+DEFINE_EVENT(aesd_io_exit, aesd_write_exit,
+	TP_PROTO(unsigned int minor, loff_t pos, ssize_t ret),
+	TP_ARGS(minor, pos, ret));
+
+TRACE_EVENT(aesd_llseek_enter,
+	TP_PROTO(unsigned int minor, loff_t offset, int whence),
+	TP_ARGS(minor, offset, whence),
+	TP_STRUCT__entry(
+		__field(unsigned int, minor)
+		__field(loff_t, offset)
+		__field(int, whence)
+	),
+	TP_fast_assign(
+		__entry->minor = minor;
+		__entry->offset = offset;
+		__entry->whence = whence;
+	),
+	TP_printk("minor=%u offset=%lld whence=%d",
+		__entry->minor, __entry->offset, __entry->whence)
+);
+
+/* size is the history size the seek was checked against */
+TRACE_EVENT(aesd_llseek_exit,
+	TP_PROTO(unsigned int minor, loff_t ret, size_t size),
+	TP_ARGS(minor, ret, size),
+	TP_STRUCT__entry(
+		__field(unsigned int, minor)
+		__field(loff_t, ret)
+		__field(size_t, size)
+	),
+	TP_fast_assign(
+		__entry->minor = minor;
+		__entry->ret = ret;
+		__entry->size = size;
+	),
+	TP_printk("minor=%u ret=%lld size=%zu", __entry->minor, __entry->ret, __entry->size)
+);
+
+TRACE_EVENT(aesd_ioctl_enter,
+	TP_PROTO(unsigned int minor, unsigned int cmd),
+	TP_ARGS(minor, cmd),
+	TP_STRUCT__entry(
+		__field(unsigned int, minor)
+		__field(unsigned int, cmd)
+	),
+	TP_fast_assign(
+		__entry->minor = minor;
+		__entry->cmd = cmd;
+	),
+	TP_printk("minor=%u cmd=%#x", __entry->minor, __entry->cmd)
+);
+
+TRACE_EVENT(aesd_ioctl_exit,
+	TP_PROTO(unsigned int minor, unsigned int cmd, long ret),
+	TP_ARGS(minor, cmd, ret),
+	TP_STRUCT__entry(
+		__field(unsigned int, minor)
+		__field(unsigned int, cmd)
+		__field(long, ret)
+	),
+	TP_fast_assign(
+		__entry->minor = minor;
+		__entry->cmd = cmd;
+		__entry->ret = ret;
+	),
+	TP_printk("minor=%u cmd=%#x ret=%ld", __entry->minor, __entry->cmd, __entry->ret)
+);
+
+/* file is set for the lock of an open file, clear for the device lock */
+DECLARE_EVENT_CLASS(aesd_lock,
+	TP_PROTO(unsigned int minor, const struct mutex *lock, bool file),
+	TP_ARGS(minor, lock, file),
+	TP_STRUCT__entry(
+		__field(unsigned int, minor)
+		__field(const void *, lock)
+		__field(bool, file)
+	),
+	TP_fast_assign(
+		__entry->minor = minor;
+		__entry->lock = lock;
+		__entry->file = file;
+	),
+	TP_printk("minor=%u lock=%s:%p", __entry->minor, __entry->file ? "file" : "dev", __entry->lock)
+);
+
+DEFINE_EVENT(aesd_lock, aesd_lock_acquire,
+	TP_PROTO(unsigned int minor, const struct mutex *lock, bool file),
+	TP_ARGS(minor, lock, file));
+
+DEFINE_EVENT(aesd_lock, aesd_lock_acquired,
+	TP_PROTO(unsigned int minor, const struct mutex *lock, bool file),
+	TP_ARGS(minor, lock, file));
+
+/* an acquire that gave up: a nowait trylock found the lock taken, or the wait was interrupted */
+DEFINE_EVENT(aesd_lock, aesd_lock_fail,
+	TP_PROTO(unsigned int minor, const struct mutex *lock, bool file),
+	TP_ARGS(minor, lock, file));
+
+DEFINE_EVENT(aesd_lock, aesd_lock_release,
+	TP_PROTO(unsigned int minor, const struct mutex *lock, bool file),
+	TP_ARGS(minor, lock, file));
+
+/* seq numbers the entry as struct aesd_index_entry does, offs is its stream offset */
+DECLARE_EVENT_CLASS(aesd_entry,
+	TP_PROTO(const struct aesd_circular_buffer *buffer, size_t seq, size_t offs, size_t size),
+	TP_ARGS(buffer, seq, offs, size),
+	TP_STRUCT__entry(
+		__field(const void *, buffer)
+		__field(size_t, seq)
+		__field(size_t, offs)
+		__field(size_t, size)
+	),
+	TP_fast_assign(
+		__entry->buffer = buffer;
+		__entry->seq = seq;
+		__entry->offs = offs;
+		__entry->size = size;
+	),
+	TP_printk("buffer=%p seq=%zu offs=%zu size=%zu",
+		__entry->buffer, __entry->seq, __entry->offs, __entry->size)
+);
+
+DEFINE_EVENT(aesd_entry, aesd_entry_add,
+	TP_PROTO(const struct aesd_circular_buffer *buffer, size_t seq, size_t offs, size_t size),
+	TP_ARGS(buffer, seq, offs, size));
+
+DEFINE_EVENT(aesd_entry, aesd_entry_evict,
+	TP_PROTO(const struct aesd_circular_buffer *buffer, size_t seq, size_t offs, size_t size),
+	TP_ARGS(buffer, seq, offs, size));
+
+#endif /* AESD_CHAR_DRIVER_AESDCHAR_TRACE_H_ */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE aesdchar_trace
+#include <trace/define_trace.h>
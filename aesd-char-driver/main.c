@@ -12,145 +12,976 @@
  */
 
 #include <linux/module.h>
+#include <linux/moduleparam.h>
 #include <linux/init.h>
 #include <linux/printk.h>
 #include <linux/types.h>
 #include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/overflow.h>
 #include <linux/cdev.h>
 #include <linux/fs.h> // file_operations
+#include <linux/uio.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/sched/signal.h>
+#include <linux/seqlock.h>
+#include <linux/spinlock.h>
+#include <linux/srcu.h>
+#include <linux/splice.h>
+#include <linux/version.h>
+#include <linux/percpu.h>
+#include <linux/ktime.h>
+#include <linux/bitops.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
 #include "aesdchar.h"
 #include "aesd_ioctl.h"
 
+#define CREATE_TRACE_POINTS
+#include "aesdchar_trace.h"
+
 int aesd_major =   0; // use dynamic major
 int aesd_minor =   0;
 
+static unsigned long max_entries = AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+module_param(max_entries, ulong, 0444);
+MODULE_PARM_DESC(max_entries, "Number of most recent writes kept by each device");
+
+static unsigned long max_bytes = 0;
+module_param(max_bytes, ulong, 0444);
+MODULE_PARM_DESC(max_bytes, "Most bytes kept by each device, oldest writes are evicted first (0: no limit)");
+
+static unsigned long ring_bytes = 0;
+module_param(ring_bytes, ulong, 0444);
+MODULE_PARM_DESC(ring_bytes, "Size of the preallocated byte ring of each device writes are packed into, rounded up to whole pages; needed for mmap (0: allocate every write)");
+
+static unsigned int num_devices = 1;
+module_param(num_devices, uint, 0444);
+MODULE_PARM_DESC(num_devices, "Number of independent devices, minors 0 to num_devices - 1, each with its own history and lock");
+
 MODULE_AUTHOR("Martin Stradiot");
 MODULE_LICENSE("Dual BSD/GPL");
 
-struct aesd_dev aesd_device;
+struct aesd_dev *aesd_devices; /* num_devices of them, one per minor */
+
+static struct dentry *aesd_debugfs; /* <debugfs>/aesdchar, a directory of statistics per minor */
+
+static const char *const aesd_stat_names[AESD_NR_STATS] = {
+	[AESD_STAT_BYTES_WRITTEN] = "bytes_written",
+	[AESD_STAT_ENTRIES_WRITTEN] = "entries_written",
+	[AESD_STAT_READS] = "reads",
+	[AESD_STAT_BYTES_READ] = "bytes_read",
+	[AESD_STAT_EVICTIONS] = "evictions",
+	[AESD_STAT_LOCK_WAIT_NS] = "lock_wait_ns",
+	[AESD_STAT_SEEKS] = "seeks",
+};
+
+/**
+ * @return the minor number of @param dev, which tracepoints identify it by
+ */
+static inline unsigned int aesd_dev_minor(struct aesd_dev *dev)
+{
+	return MINOR(dev->cdev.dev);
+}
+
+static inline void aesd_stat_add(struct aesd_dev *dev, enum aesd_stat stat, u64 value)
+{
+	this_cpu_add(dev->stats->count[stat], value);
+}
+
+/**
+ * @return the histogram bucket of a latency of @param ns nanoseconds
+ */
+static inline unsigned int aesd_lat_bucket(u64 ns)
+{
+	return min_t(unsigned int, fls64(ns), AESD_LAT_BUCKETS - 1);
+}
+
+/**
+ * Accounts the time since @param start, taken with ktime_get_ns() before
+ * asking for a lock, as time spent waiting for locks.
+ */
+static inline void aesd_stat_lock_wait(struct aesd_dev *dev, u64 start)
+{
+	aesd_stat_add(dev, AESD_STAT_LOCK_WAIT_NS, ktime_get_ns() - start);
+}
+
+/**
+ * Accounts a read started at @param start returning @param retval.
+ */
+static void aesd_stat_read(struct aesd_dev *dev, ssize_t retval, u64 start)
+{
+	aesd_stat_add(dev, AESD_STAT_READS, 1);
+	if (retval > 0){
+		aesd_stat_add(dev, AESD_STAT_BYTES_READ, retval);
+	}
+	this_cpu_inc(dev->stats->read_lat[aesd_lat_bucket(ktime_get_ns() - start)]);
+}
+
+/**
+ * Accounts a write started at @param start returning @param retval.
+ */
+static void aesd_stat_write(struct aesd_dev *dev, ssize_t retval, u64 start)
+{
+	if (retval > 0){
+		aesd_stat_add(dev, AESD_STAT_BYTES_WRITTEN, retval);
+	}
+	this_cpu_inc(dev->stats->write_lat[aesd_lat_bucket(ktime_get_ns() - start)]);
+}
+
+static void aesd_park_staging(struct aesd_file *file);
 
 int aesd_open(struct inode *inode, struct file *filp)
 {
+	struct aesd_file *file;
+
     PDEBUG("open");
-    /**
-     * TODO: handle open
-     */
-	filp->private_data = container_of(inode->i_cdev, struct aesd_dev, cdev); 
+	file = kzalloc(sizeof(*file), GFP_KERNEL);
+	if (file == NULL){
+		return -ENOMEM;
+	}
+	file->dev = container_of(inode->i_cdev, struct aesd_dev, cdev);
+	mutex_init(&file->lock);
+	spin_lock_init(&file->pos_lock);
+	file->pos = -1;
+	filp->private_data = file;
+	/* reads and writes honour IOCB_NOWAIT, so io_uring may issue them inline */
+	filp->f_mode |= FMODE_NOWAIT;
     return 0;
 }
 
 int aesd_release(struct inode *inode, struct file *filp)
 {
+	struct aesd_file *file = filp->private_data;
+
     PDEBUG("release");
-    /**
-     * TODO: handle release
-     */
+	aesd_park_staging(file);
+	mutex_destroy(&file->lock);
+	kfree(file);
     return 0;
 }
 
+/**
+ * A write kept in its own allocation. Lockless readers may still be copying
+ * it when it is evicted, so it is freed after an SRCU grace period.
+ */
+struct aesd_entry_buf {
+	struct rcu_head rcu;
+	char data[];
+};
+
+/**
+ * @return the stream offset of the oldest byte kept in @param buffer
+ */
+static inline size_t aesd_stream_start(struct aesd_circular_buffer *buffer)
+{
+	return buffer->end_offs - aesd_circular_buffer_size(buffer);
+}
+
+/**
+ * Turns the offset @param fpos a read or poll of @param filp starts at into a
+ * stream offset. A read at the file offset, as left by the previous read of
+ * the file, counts from the oldest byte kept back then, so it names the same
+ * byte however many writes were evicted since. Any other offset, as passed to
+ * pread or set by llseek, counts from the oldest byte kept now; a pread at
+ * exactly the file offset cannot be told from a read and reads the same.
+ * @param start set to the stream offset of the oldest byte kept now
+ * @param tracked set if fpos is the file offset, which aesd_read_end() then
+ *      remembers; may be NULL
+ * @return the stream offset, moved up to *start if that byte was evicted
+ */
+static size_t aesd_read_begin(struct file *filp, loff_t fpos, size_t *start, bool *tracked)
+{
+	struct aesd_file *file = filp->private_data;
+	struct aesd_dev *dev = file->dev;
+	bool at_f_pos = (fpos == READ_ONCE(filp->f_pos));
+	size_t pos;
+	unsigned int seq;
+
+	do {
+		seq = read_seqcount_begin(&dev->seq);
+		*start = aesd_stream_start(&dev->c_buffer);
+	} while (read_seqcount_retry(&dev->seq, seq));
+
+	pos = *start + fpos;
+	if (at_f_pos){
+		spin_lock(&file->pos_lock);
+		if (fpos == file->pos){
+			pos = file->anchor + fpos;
+		}
+		spin_unlock(&file->pos_lock);
+	}
+	if (tracked != NULL){
+		*tracked = at_f_pos;
+	}
+	return max(pos, *start);
+}
+
+/**
+ * Leaves the file offset of a read that ended at stream offset @param pos
+ * counting from @param start, the oldest byte kept in the last snapshot the
+ * read looked at. A read of the file offset, @param tracked as set by
+ * aesd_read_begin(), remembers both for the next read of @param file.
+ */
+static void aesd_read_end(struct aesd_file *file, loff_t *f_pos, size_t pos, size_t start, bool tracked)
+{
+	*f_pos = pos - start;
+	if (tracked){
+		spin_lock(&file->pos_lock);
+		file->anchor = start;
+		file->pos = *f_pos;
+		spin_unlock(&file->pos_lock);
+	}
+}
+
+/**
+ * Looks up the bytes stored at stream offset *pos without taking dev->lock,
+ * in a consistent snapshot of the descriptors. The bytes stay allocated for
+ * as long as the caller holds dev->srcu.
+ * @param start set to the stream offset of the oldest byte kept in the
+ *      snapshot, unless NULL is returned for a span after the first
+ * @param first set for the first span of a read, which is moved up to the
+ *      oldest byte kept if *pos was evicted. The later spans of a read
+ *      continue the same bytes or fail.
+ * @return the span as for aesd_circular_buffer_span_for_fpos(), or NULL if
+ * *pos is past the history or was evicted since the read began
+ */
+static const char *aesd_read_span(struct aesd_dev *dev, size_t *pos, size_t *start, bool first,
+		size_t max_len, size_t *len_rtn)
+{
+	const char *span;
+	size_t oldest, at;
+	unsigned int seq;
+
+	do {
+		seq = read_seqcount_begin(&dev->seq);
+		oldest = aesd_stream_start(&dev->c_buffer);
+		at = (first && *pos < oldest) ? oldest : *pos;
+		span = NULL;
+		if (at >= oldest){
+			span = aesd_circular_buffer_span_for_fpos(&dev->c_buffer, at - oldest, max_len, len_rtn);
+		}
+	} while (read_seqcount_retry(&dev->seq, seq));
+
+	if (span != NULL || first){
+		*pos = at;
+		*start = oldest;
+	}
+	return span;
+}
+
+/**
+ * Ring bytes are reused as soon as they are evicted, so a span copied from
+ * the ring must be checked afterwards to still be part of the history.
+ * Writes in their own allocations never change once stored.
+ * @return true if the span read at stream offset @param pos with
+ * aesd_read_span() may have been overwritten while it was copied
+ */
+static bool aesd_span_evicted(struct aesd_dev *dev, size_t pos)
+{
+	size_t start_now;
+	unsigned int seq;
+
+	if (dev->c_buffer.ring == NULL){
+		return false;
+	}
+
+	/*
+	 * Order the loads of the copy before the re-check, pairing with the
+	 * write_seqcount_end() that publishes an eviction before the writer
+	 * overwrites the bytes. Bytes seen overwritten then mean start_now moved.
+	 */
+	smp_rmb();
+	do {
+		seq = read_seqcount_begin(&dev->seq);
+		start_now = aesd_stream_start(&dev->c_buffer);
+	} while (read_seqcount_retry(&dev->seq, seq));
+
+	return start_now > pos;
+}
+
+/**
+ * Sleeps until the history reaches past stream offset @param pos, for a read
+ * that found nothing there. Stream offsets only grow, so a write added after
+ * the failed lookup is never missed.
+ * @param nowait set for a non-blocking file or an IOCB_NOWAIT request
+ * @return 0 when there is new data, -EAGAIN when @param nowait is set or
+ * -ERESTARTSYS on a signal
+ */
+static int aesd_wait_for_entries(struct aesd_dev *dev, bool nowait, size_t pos)
+{
+	if (nowait){
+		return -EAGAIN;
+	}
+
+	PDEBUG("waiting for writes after %zu", pos);
+	if (wait_event_interruptible(dev->readq, READ_ONCE(dev->c_buffer.end_offs) > pos)){
+		return -ERESTARTSYS;
+	}
+	return 0;
+}
+
+/**
+ * Fills the user buffer with as much of the history from f_pos on as fits,
+ * across entries, without taking dev->lock: readers only retry when a write
+ * changed the descriptors under them. A read stops early rather than skip
+ * bytes evicted while it copies. Consecutive entries of the byte
+ * ring are copied together, so reading the whole ring takes one copy through
+ * its mirror; otherwise there is one copy per entry. On a file set to tail
+ * with AESDCHAR_IOCSTAIL, a read finding nothing left waits for the next write.
+ */
 ssize_t aesd_read(struct file *filp, char __user *buf, size_t count,
                 loff_t *f_pos)
 {
     ssize_t retval = 0;
     PDEBUG("read %zu bytes with offset %lld",count,*f_pos);
-    /*
-     * TODO: handle read
-     */
-    struct aesd_dev *dev = filp->private_data;
+    struct aesd_file *file = filp->private_data;
+    struct aesd_dev *dev = file->dev;
+	const char *span;
+	size_t span_len, pos, stream_start;
+	u64 start = ktime_get_ns();
+	bool tracked;
+	int err, idx;
 
-	size_t entry_offset;
+	trace_aesd_read_enter(aesd_dev_minor(dev), *f_pos, count);
+	pos = aesd_read_begin(filp, *f_pos, &stream_start, &tracked);
+	idx = srcu_read_lock(&dev->srcu);
 
-	if (mutex_lock_interruptible(&dev->lock)){
-		return -ERESTARTSYS;
+	while (retval < count){
+		span = aesd_read_span(dev, &pos, &stream_start, retval == 0, count - retval, &span_len);
+		if (span == NULL){
+			if (retval == 0 && READ_ONCE(file->tail)){
+				srcu_read_unlock(&dev->srcu, idx);
+				err = aesd_wait_for_entries(dev, filp->f_flags & O_NONBLOCK, pos);
+				if (err){
+					aesd_read_end(file, f_pos, pos, stream_start, tracked);
+					trace_aesd_read_exit(aesd_dev_minor(dev), *f_pos, err);
+					return err;
+				}
+				idx = srcu_read_lock(&dev->srcu);
+				continue;
+			}
+			break;
+		}
+		if (copy_to_user(buf + retval, span, span_len)){
+			if (retval == 0){
+				retval = -EFAULT;
+			}
+			break;
+		}
+		if (aesd_span_evicted(dev, pos)){
+			if (retval == 0){
+				/* copy whatever is at pos now over the stale bytes */
+				continue;
+			}
+			break;
+		}
+		pos += span_len;
+		retval += span_len;
 	}
 
-	struct aesd_buffer_entry* entry = aesd_circular_buffer_find_entry_offset_for_fpos(
-		&(dev->c_buffer),
-		*f_pos,
-		&entry_offset
-	);
+	srcu_read_unlock(&dev->srcu, idx);
+	aesd_read_end(file, f_pos, pos, stream_start, tracked);
+	aesd_stat_read(dev, retval, start);
+	trace_aesd_read_exit(aesd_dev_minor(dev), *f_pos, retval);
 
-	mutex_unlock(&dev->lock);
+    return retval;
+}
+
+/**
+ * Iterator based read, used by readv, io_uring and splice, the latter so
+ * /dev/aesdchar contents can be moved into a pipe (and on to a socket)
+ * without a copy through user space.
+ * Like aesd_read, fills the iterator across entries without taking dev->lock
+ * and waits at the end of the history on a file set to tail.
+ */
+ssize_t aesd_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+    ssize_t retval = 0;
+    struct aesd_file *file = iocb->ki_filp->private_data;
+    struct aesd_dev *dev = file->dev;
+	const char *span;
+	size_t span_len, copied, pos, stream_start;
+	u64 start = ktime_get_ns();
+	bool tracked;
+	int err, idx;
+
+    PDEBUG("read_iter %zu bytes with offset %lld", iov_iter_count(to), iocb->ki_pos);
 
-	if (entry != NULL){
-		size_t unread_bytes = entry->size - entry_offset;
-		size_t read_size = (unread_bytes > count) ? count : unread_bytes;
+	trace_aesd_read_enter(aesd_dev_minor(dev), iocb->ki_pos, iov_iter_count(to));
+	pos = aesd_read_begin(iocb->ki_filp, iocb->ki_pos, &stream_start, &tracked);
+	idx = srcu_read_lock(&dev->srcu);
 
-		PDEBUG("Reading message %.*s of size %zu", read_size, entry->buffptr + entry_offset, read_size);
-		if (copy_to_user(buf, entry->buffptr + entry_offset, read_size)){
-			return -EINTR;
+	while (iov_iter_count(to) > 0){
+		span = aesd_read_span(dev, &pos, &stream_start, retval == 0, iov_iter_count(to), &span_len);
+		if (span == NULL){
+			if (retval == 0 && READ_ONCE(file->tail)){
+				srcu_read_unlock(&dev->srcu, idx);
+				err = aesd_wait_for_entries(dev,
+						(iocb->ki_filp->f_flags & O_NONBLOCK) || (iocb->ki_flags & IOCB_NOWAIT),
+						pos);
+				if (err){
+					aesd_read_end(file, &iocb->ki_pos, pos, stream_start, tracked);
+					trace_aesd_read_exit(aesd_dev_minor(dev), iocb->ki_pos, err);
+					return err;
+				}
+				idx = srcu_read_lock(&dev->srcu);
+				continue;
+			}
+			break;
+		}
+		copied = copy_to_iter(span, span_len, to);
+		if (aesd_span_evicted(dev, pos)){
+			iov_iter_revert(to, copied);
+			if (retval == 0){
+				continue;
+			}
+			break;
+		}
+		pos += copied;
+		retval += copied;
+		if (copied != span_len){
+			if (retval == 0){
+				retval = -EFAULT;
+			}
+			break;
 		}
-		*f_pos += read_size;
-		retval = read_size;
 	}
 
+	srcu_read_unlock(&dev->srcu, idx);
+	aesd_read_end(file, &iocb->ki_pos, pos, stream_start, tracked);
+	aesd_stat_read(dev, retval, start);
+	trace_aesd_read_exit(aesd_dev_minor(dev), iocb->ki_pos, retval);
+
     return retval;
 }
 
-ssize_t aesd_write(struct file *filp, const char __user *buf, size_t count,
-                loff_t *f_pos)
+/**
+ * Marks the mapped header as being updated, readers of the mapping retry
+ * until the matching aesd_mmap_write_end().
+ */
+static void aesd_mmap_write_begin(struct aesd_dev *dev)
 {
-    ssize_t retval = -ENOMEM;
-    PDEBUG("write %zu bytes with offset %lld",count,*f_pos);
-    /**
-     * TODO: handle write
-     */
-    struct aesd_dev *dev = filp->private_data;
+	if (dev->mmap_header != NULL){
+		WRITE_ONCE(dev->mmap_header->seq, dev->mmap_header->seq + 1);
+		smp_wmb();
+	}
+}
 
-	if (mutex_lock_interruptible(&dev->lock)){
-		return -ERESTARTSYS;
+/**
+ * Publishes the current history bounds in the mapped header.
+ */
+static void aesd_mmap_write_end(struct aesd_dev *dev)
+{
+	struct aesd_mmap_header *header = dev->mmap_header;
+
+	if (header != NULL){
+		header->in_offs = dev->c_buffer.in_offs;
+		header->out_offs = dev->c_buffer.out_offs;
+		header->full = dev->c_buffer.full;
+		smp_wmb();
+		WRITE_ONCE(header->seq, header->seq + 1);
+	}
+}
+
+/**
+ * Copies the entry just added to the history into the mapped header.
+ */
+static void aesd_mmap_store_entry(struct aesd_dev *dev)
+{
+	struct aesd_circular_buffer *buffer = &dev->c_buffer;
+	size_t index = (buffer->in_offs + buffer->capacity - 1) % buffer->capacity;
+
+	if (dev->mmap_header != NULL){
+		dev->mmap_header->entry[index].offset = buffer->entry[index].buffptr - buffer->ring;
+		dev->mmap_header->entry[index].size = buffer->entry[index].size;
+	}
+}
+
+static void aesd_free_entry_buf(struct rcu_head *rcu)
+{
+	kfree(container_of(rcu, struct aesd_entry_buf, rcu));
+}
+
+/**
+ * Frees a write evicted from the history once no reader can be copying it.
+ * Writes packed into the byte ring are not separate allocations and need
+ * nothing.
+ */
+static void aesd_release_entry(struct aesd_dev *dev, const char *buffptr)
+{
+	if (dev->c_buffer.ring == NULL && buffptr != NULL){
+		call_srcu(&dev->srcu, &container_of(buffptr, struct aesd_entry_buf, data[0])->rcu,
+			aesd_free_entry_buf);
 	}
+}
 
-	dev->c_buffer_entry.buffptr = krealloc(
-		dev->c_buffer_entry.buffptr,
-		dev->c_buffer_entry.size + count,
-		GFP_KERNEL
-	);
+/**
+ * @param nowait set to allocate without sleeping, for an IOCB_NOWAIT write
+ * @return a copy of the size bytes at buffptr in an allocation of its own,
+ * or NULL if out of memory
+ */
+static const char *aesd_dup_entry(const char *buffptr, size_t size, bool nowait)
+{
+	struct aesd_entry_buf *buf = kmalloc(struct_size(buf, data, size), nowait ? GFP_NOWAIT : GFP_KERNEL);
+
+	if (buf == NULL){
+		return NULL;
+	}
+	memcpy(buf->data, buffptr, size);
+	return buf->data;
+}
+
+/**
+ * @return bytes allocated for the buffer of a command being written
+ */
+static inline size_t aesd_staging_alloc_size(const struct aesd_staging *staging)
+{
+	return (staging->entry.buffptr != NULL) ? sizeof(struct aesd_entry_buf) + staging->alloc : 0;
+}
 
-	if(copy_from_user(
-		dev->c_buffer_entry.buffptr + dev->c_buffer_entry.size,
-		buf,
-		count
-	)){
-		return -EINTR;
+/**
+ * Frees the buffer of a command being written to @param dev.
+ */
+static void aesd_free_staging(struct aesd_dev *dev, struct aesd_staging *staging)
+{
+	atomic_long_sub(aesd_staging_alloc_size(staging), &dev->staging_bytes);
+	if (staging->entry.buffptr != NULL){
+		kfree(container_of(staging->entry.buffptr, struct aesd_entry_buf, data[0]));
 	}
-	dev->c_buffer_entry.size += count;
+	memset(staging, 0, sizeof(*staging));
+}
 
-	if(strchr(dev->c_buffer_entry.buffptr, '\n') != NULL){
-		const char* deleted_item = aesd_circular_buffer_add_entry(&(dev->c_buffer), &(dev->c_buffer_entry)); 
-		PDEBUG("Added entry %s", dev->c_buffer_entry.buffptr);
+/**
+ * Makes room for count more bytes of a command being written. The allocation
+ * grows geometrically, so a command written a byte at a time costs amortized
+ * constant time per byte. The allocation is accounted to @param dev.
+ * @param nowait set to allocate without sleeping, for an IOCB_NOWAIT write
+ * @return where the bytes go, or NULL if out of memory
+ */
+static char *aesd_stage_write(struct aesd_dev *dev, struct aesd_staging *staging, size_t count, bool nowait)
+{
+	struct aesd_buffer_entry *pending = &staging->entry;
+	size_t needed = pending->size + count;
+	size_t alloc = staging->alloc;
+	struct aesd_entry_buf *buf;
 
-		if (deleted_item != NULL){
-			PDEBUG("Deleted entry %s", deleted_item);
-			kfree(deleted_item);
+	if (needed > alloc){
+		alloc = max_t(size_t, alloc, AESD_WRITE_MIN_ALLOC);
+		while (alloc < needed){
+			alloc = (alloc > SIZE_MAX / 2) ? needed : alloc * 2;
+		}
+		buf = krealloc(pending->buffptr ? container_of(pending->buffptr, struct aesd_entry_buf, data[0]) : NULL,
+			struct_size(buf, data, alloc), nowait ? GFP_NOWAIT : GFP_KERNEL);
+		if (buf == NULL){
+			return NULL;
 		}
+		atomic_long_sub(aesd_staging_alloc_size(staging), &dev->staging_bytes);
+		pending->buffptr = buf->data;
+		staging->alloc = alloc;
+		atomic_long_add(aesd_staging_alloc_size(staging), &dev->staging_bytes);
+	}
 
-		memset(&dev->c_buffer_entry, 0, sizeof(struct aesd_buffer_entry));
+	return (char *)pending->buffptr + pending->size;
+}
+
+/**
+ * Continues the command a file closed in the middle of, in a write through
+ * @param file that starts a new command. Commands are staged per file, but a
+ * command written with several opens, as by successive echo -n, still ends up
+ * as one entry.
+ * @param nowait set to fail rather than wait for dev->lock
+ * @return 0, or -EAGAIN if @param nowait is set and dev->lock is taken
+ */
+static int aesd_adopt_parked(struct aesd_file *file, bool nowait)
+{
+	struct aesd_dev *dev = file->dev;
+	struct aesd_staging parked;
+
+	if (file->staging.entry.size != 0 || file->staging.dropped ||
+		(READ_ONCE(dev->parked.entry.size) == 0 && !READ_ONCE(dev->parked.dropped))){
+		return 0;
+	}
+
+	trace_aesd_lock_acquire(aesd_dev_minor(dev), &dev->lock, false);
+	if (nowait){
+		if (!mutex_trylock(&dev->lock)){
+			trace_aesd_lock_fail(aesd_dev_minor(dev), &dev->lock, false);
+			return -EAGAIN;
+		}
+	} else {
+		mutex_lock(&dev->lock);
+	}
+	trace_aesd_lock_acquired(aesd_dev_minor(dev), &dev->lock, false);
+	parked = dev->parked;
+	memset(&dev->parked, 0, sizeof(dev->parked));
+	trace_aesd_lock_release(aesd_dev_minor(dev), &dev->lock, false);
+	mutex_unlock(&dev->lock);
+
+	if (parked.entry.size != 0 || parked.dropped){
+		aesd_free_staging(dev, &file->staging);
+		file->staging = parked;
+	}
+	return 0;
+}
+
+/**
+ * Leaves the unfinished command of a file being closed to the next write that
+ * starts a command, unless another closed file left one already.
+ */
+static void aesd_park_staging(struct aesd_file *file)
+{
+	struct aesd_dev *dev = file->dev;
+
+	if (file->staging.entry.size != 0 || file->staging.dropped){
+		trace_aesd_lock_acquire(aesd_dev_minor(dev), &dev->lock, false);
+		mutex_lock(&dev->lock);
+		trace_aesd_lock_acquired(aesd_dev_minor(dev), &dev->lock, false);
+		if (dev->parked.entry.size == 0 && !dev->parked.dropped){
+			dev->parked = file->staging;
+			memset(&file->staging, 0, sizeof(file->staging));
+		}
+		trace_aesd_lock_release(aesd_dev_minor(dev), &dev->lock, false);
+		mutex_unlock(&dev->lock);
 	}
 
-	retval = count;
+	aesd_free_staging(dev, &file->staging);
+}
+
+/**
+ * Adds a completed command to the history, evicting what the retention
+ * bounds require, as one change seen by lockless readers.
+ */
+static void aesd_store_entry(struct aesd_dev *dev, const struct aesd_buffer_entry *entry)
+{
+	const char* deleted_item;
+
+	write_seqcount_begin(&dev->seq);
+	while ((deleted_item = aesd_circular_buffer_make_room(&dev->c_buffer, entry->size)) != NULL){
+		PDEBUG("Evicted entry %p", deleted_item);
+		aesd_release_entry(dev, deleted_item);
+	}
 
-	*f_pos += count;
+	deleted_item = aesd_circular_buffer_add_entry(&dev->c_buffer, entry);
+	write_seqcount_end(&dev->seq);
+	PDEBUG("Added entry of %zu bytes", entry->size);
+	aesd_mmap_store_entry(dev);
+	wake_up_interruptible(&dev->readq);
+
+	if (deleted_item != NULL){
+		PDEBUG("Deleted entry %p", deleted_item);
+		aesd_release_entry(dev, deleted_item);
+	}
+}
+
+/**
+ * Adds a completed command to the history of @param dev. This is the only
+ * step of a write taking dev->lock. A command for the byte ring is copied
+ * into it; otherwise the history takes over entry->buffptr.
+ * @param nowait set to fail rather than wait for dev->lock
+ * @return 0, or -EAGAIN if @param nowait is set and dev->lock is taken, in
+ * which case entry->buffptr stays with the caller
+ */
+static int aesd_publish_entry(struct aesd_dev *dev, const struct aesd_buffer_entry *entry, bool nowait)
+{
+	struct aesd_buffer_entry stored = *entry;
+	char *ring_ptr = NULL;
+	u64 start = ktime_get_ns();
+	size_t count;
 
+	trace_aesd_lock_acquire(aesd_dev_minor(dev), &dev->lock, false);
+	if (nowait){
+		if (!mutex_trylock(&dev->lock)){
+			trace_aesd_lock_fail(aesd_dev_minor(dev), &dev->lock, false);
+			return -EAGAIN;
+		}
+	} else {
+		mutex_lock(&dev->lock);
+	}
+	trace_aesd_lock_acquired(aesd_dev_minor(dev), &dev->lock, false);
+	aesd_stat_lock_wait(dev, start);
+	count = aesd_circular_buffer_count(&dev->c_buffer);
+	aesd_mmap_write_begin(dev);
+
+	if (dev->c_buffer.ring != NULL){
+		write_seqcount_begin(&dev->seq);
+		ring_ptr = aesd_circular_buffer_ring_reserve(&dev->c_buffer, entry->size);
+		write_seqcount_end(&dev->seq);
+		/* aesd_write never stages a command larger than the ring */
+		memcpy(ring_ptr, entry->buffptr, entry->size);
+		stored.buffptr = ring_ptr;
+	}
+	aesd_store_entry(dev, &stored);
+
+	aesd_mmap_write_end(dev);
+	aesd_stat_add(dev, AESD_STAT_ENTRIES_WRITTEN, 1);
+	aesd_stat_add(dev, AESD_STAT_EVICTIONS, count + 1 - aesd_circular_buffer_count(&dev->c_buffer));
+	trace_aesd_lock_release(aesd_dev_minor(dev), &dev->lock, false);
 	mutex_unlock(&dev->lock);
+	return 0;
+}
+
+/**
+ * Publishes every complete command staged in @param file as its own entry,
+ * searching for newlines from byte scan on, and keeps the rest staged.
+ * Without a byte ring the last command takes over the staging buffer and the
+ * ones before it are copied out, before taking the device lock.
+ * @param nowait set to neither sleep in allocations nor wait for the device
+ * lock, for an IOCB_NOWAIT write
+ * @return number of staged bytes accepted, all of them unless storing a
+ * command ran out of memory or would have waited, or -ENOMEM or -EAGAIN if
+ * not even the first one could be
+ */
+static ssize_t aesd_commit_lines(struct aesd_file *file, size_t scan, bool nowait)
+{
+	struct aesd_dev *dev = file->dev;
+	struct aesd_staging *staging = &file->staging;
+	struct aesd_buffer_entry *pending = &staging->entry;
+	struct aesd_buffer_entry entry;
+	char *buffptr = (char *)pending->buffptr;
+	const char *newline;
+	size_t start = 0, accepted;
+
+	while ((newline = memchr(buffptr + scan, '\n', pending->size - scan)) != NULL){
+		entry.size = newline + 1 - (buffptr + start);
+		if (staging->dropped){
+			/* the end of a command too large for the ring, dropped along with it */
+			staging->dropped = false;
+			start += entry.size;
+			scan = start;
+			continue;
+		}
+		if (dev->c_buffer.ring != NULL){
+			entry.buffptr = buffptr + start;
+		} else if (start + entry.size == pending->size){
+			memmove(buffptr, buffptr + start, entry.size);
+			entry.buffptr = buffptr;
+			buffptr = NULL;
+		} else {
+			entry.buffptr = aesd_dup_entry(buffptr + start, entry.size, nowait);
+			if (entry.buffptr == NULL){
+				break;
+			}
+		}
+
+		if (aesd_publish_entry(dev, &entry, nowait)){
+			if (buffptr == NULL){
+				/* the command was moved to the front of the staging buffer, which stays */
+				buffptr = (char *)entry.buffptr;
+			} else if (dev->c_buffer.ring == NULL){
+				kfree(container_of(entry.buffptr, struct aesd_entry_buf, data[0]));
+			}
+			break;
+		}
+		start += entry.size;
+		scan = start;
+	}
+
+	if (newline != NULL){
+		/* out of memory or busy, the commands from start on are not accepted */
+		if (start == 0){
+			return nowait ? -EAGAIN : -ENOMEM;
+		}
+		pending->size = 0;
+		return start;
+	}
+
+	accepted = pending->size;
+	if (buffptr == NULL){
+		/* the staging buffer now belongs to the last entry */
+		atomic_long_sub(aesd_staging_alloc_size(staging), &dev->staging_bytes);
+		memset(staging, 0, sizeof(*staging));
+	} else {
+		memmove(buffptr, buffptr + start, pending->size - start);
+		pending->size -= start;
+	}
+
+	return accepted;
+}
+
+/**
+ * Copies @param count written bytes into the staging of the file, outside of
+ * the device lock, and publishes each command completed by a newline. The
+ * bytes come from the user buffer @param buf, or from the iterator
+ * @param from when it is not NULL, which is then advanced past the bytes
+ * accepted only. Must be called with file->lock held.
+ * @param nowait set for an IOCB_NOWAIT write, which neither sleeps in
+ *      allocations nor waits for dev->lock
+ * @return the number of bytes accepted, or a negative error if none were,
+ * -EAGAIN if @param nowait is set and the write would have waited
+ */
+static ssize_t aesd_write_staged(struct aesd_file *file, const char __user *buf,
+		struct iov_iter *from, size_t count, bool nowait)
+{
+    ssize_t retval = 0;
+    struct aesd_dev *dev = file->dev;
+	struct aesd_buffer_entry *pending = &file->staging.entry;
+	size_t pending_size, chunk, copied;
+	ssize_t accepted = 0;
+	char *staged;
+
+	if (aesd_adopt_parked(file, nowait)){
+		return -EAGAIN;
+	}
+
+	while (retval < count){
+		/* a write spanning several commands is staged one ring full at a time */
+		chunk = count - retval;
+		if (dev->c_buffer.ring != NULL){
+			chunk = min(chunk, dev->c_buffer.ring_size - pending->size);
+		}
+
+		pending_size = pending->size;
+		if (chunk == 0){
+			/* a command larger than the byte ring can never be stored, drop it */
+			pending->size = 0;
+			file->staging.dropped = true;
+			accepted = -EFBIG;
+			break;
+		}
+		staged = aesd_stage_write(dev, &file->staging, chunk, nowait);
+		if (staged == NULL){
+			accepted = nowait ? -EAGAIN : -ENOMEM;
+			break;
+		}
+
+		if (from != NULL){
+			copied = copy_from_iter(staged, chunk, from);
+		} else {
+			copied = copy_from_user(staged, buf + retval, chunk) ? 0 : chunk;
+		}
+		if (copied != chunk){
+			if (from != NULL){
+				iov_iter_revert(from, copied);
+			}
+			accepted = -EFAULT;
+			break;
+		}
+		pending->size += chunk;
+
+		/* only the bytes just copied can hold a newline */
+		accepted = aesd_commit_lines(file, pending_size, nowait);
+		if (accepted < 0){
+			pending->size = pending_size;
+			if (from != NULL){
+				iov_iter_revert(from, chunk);
+			}
+			break;
+		}
+		retval += accepted - pending_size;
+		if (accepted - pending_size < chunk){
+			if (from != NULL){
+				iov_iter_revert(from, chunk - (accepted - pending_size));
+			}
+			break;
+		}
+	}
+
+	if (retval == 0 && count > 0){
+		retval = accepted;
+	}
 
     return retval;
 }
 
-loff_t aesd_llseek(struct file *filp, loff_t offset, int whence){
-    struct aesd_dev *dev = filp->private_data;
+ssize_t aesd_write(struct file *filp, const char __user *buf, size_t count,
+                loff_t *f_pos)
+{
+    ssize_t retval;
+    PDEBUG("write %zu bytes with offset %lld",count,*f_pos);
+	struct aesd_file *file = filp->private_data;
+	unsigned int minor = aesd_dev_minor(file->dev);
+	u64 start = ktime_get_ns();
 
-	size_t buff_size = 0;
+	trace_aesd_write_enter(minor, *f_pos, count);
+	trace_aesd_lock_acquire(minor, &file->lock, true);
+	if (mutex_lock_interruptible(&file->lock)){
+		trace_aesd_lock_fail(minor, &file->lock, true);
+		trace_aesd_write_exit(minor, *f_pos, -ERESTARTSYS);
+		return -ERESTARTSYS;
+	}
+	trace_aesd_lock_acquired(minor, &file->lock, true);
+	aesd_stat_lock_wait(file->dev, start);
+	retval = aesd_write_staged(file, buf, NULL, count, false);
+	*f_pos += (retval > 0) ? retval : 0;
+	trace_aesd_lock_release(minor, &file->lock, true);
+	mutex_unlock(&file->lock);
+	aesd_stat_write(file->dev, retval, start);
+	trace_aesd_write_exit(minor, *f_pos, retval);
 
-	uint8_t index;
-	struct aesd_buffer_entry *entry;
-	AESD_CIRCULAR_BUFFER_FOREACH(entry,&(dev->c_buffer),index) {
-		buff_size += entry->size;
+    return retval;
+}
+
+/**
+ * Iterator based write, used by writev and io_uring: the whole iterator is
+ * staged under a single hold of the file lock, so the segments of one call
+ * are never interleaved with another write through the same file. With
+ * IOCB_NOWAIT neither lock is waited for and allocations do not sleep; a
+ * write that would have waited before accepting anything fails with -EAGAIN.
+ */
+ssize_t aesd_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+    ssize_t retval;
+	struct aesd_file *file = iocb->ki_filp->private_data;
+	unsigned int minor = aesd_dev_minor(file->dev);
+	u64 start = ktime_get_ns();
+
+    PDEBUG("write_iter %zu bytes with offset %lld", iov_iter_count(from), iocb->ki_pos);
+
+	trace_aesd_write_enter(minor, iocb->ki_pos, iov_iter_count(from));
+	trace_aesd_lock_acquire(minor, &file->lock, true);
+	if (iocb->ki_flags & IOCB_NOWAIT){
+		if (!mutex_trylock(&file->lock)){
+			trace_aesd_lock_fail(minor, &file->lock, true);
+			trace_aesd_write_exit(minor, iocb->ki_pos, -EAGAIN);
+			return -EAGAIN;
+		}
+	} else if (mutex_lock_interruptible(&file->lock)){
+		trace_aesd_lock_fail(minor, &file->lock, true);
+		trace_aesd_write_exit(minor, iocb->ki_pos, -ERESTARTSYS);
+		return -ERESTARTSYS;
 	}
+	trace_aesd_lock_acquired(minor, &file->lock, true);
+	aesd_stat_lock_wait(file->dev, start);
+	retval = aesd_write_staged(file, NULL, from, iov_iter_count(from), iocb->ki_flags & IOCB_NOWAIT);
+	iocb->ki_pos += (retval > 0) ? retval : 0;
+	trace_aesd_lock_release(minor, &file->lock, true);
+	mutex_unlock(&file->lock);
+	aesd_stat_write(file->dev, retval, start);
+	trace_aesd_write_exit(minor, iocb->ki_pos, retval);
+
+    return retval;
+}
+
+loff_t aesd_llseek(struct file *filp, loff_t offset, int whence){
+    struct aesd_file *file = filp->private_data;
+    struct aesd_dev *dev = file->dev;
+
+	size_t buff_size;
+	unsigned int seq;
+	loff_t retval;
+
+	trace_aesd_llseek_enter(aesd_dev_minor(dev), offset, whence);
+	do {
+		seq = read_seqcount_begin(&dev->seq);
+		buff_size = aesd_circular_buffer_size(&dev->c_buffer);
+	} while (read_seqcount_retry(&dev->seq, seq));
 
 	PDEBUG("Seeking offset %ld in buffer with size %ld", offset, buff_size);
+	aesd_stat_add(dev, AESD_STAT_SEEKS, 1);
+
+	retval = fixed_size_llseek(filp, offset, whence, buff_size);
+	spin_lock(&file->pos_lock);
+	if (retval >= 0 && retval != file->pos){
+		/* counts from the oldest byte kept now, see aesd_read_begin() */
+		file->pos = -1;
+	}
+	spin_unlock(&file->pos_lock);
+	trace_aesd_llseek_exit(aesd_dev_minor(dev), retval, buff_size);
 
-	return fixed_size_llseek(filp, offset, whence, buff_size);
+	return retval;
 }
 
 static long aesd_adjust_file_offset(
@@ -160,41 +991,244 @@ static long aesd_adjust_file_offset(
 ){
 	long retval = 0;
 
-    struct aesd_dev *dev = filp->private_data;
+    struct aesd_file *file = filp->private_data;
+    struct aesd_dev *dev = file->dev;
+	struct aesd_buffer_entry *entry;
+	size_t cmd_offset, cmd_size = 0;
+	unsigned int seq;
 
-	if (write_cmd >= AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED){
-		return -EINVAL;
+	do {
+		seq = read_seqcount_begin(&dev->seq);
+		entry = aesd_circular_buffer_entry_at(&dev->c_buffer, write_cmd, &cmd_offset);
+		if (entry != NULL){
+			cmd_size = entry->size;
+		}
+	} while (read_seqcount_retry(&dev->seq, seq));
+
+	aesd_stat_add(dev, AESD_STAT_SEEKS, 1);
+	if (entry == NULL || write_cmd_offset >= cmd_size){
+		retval = -EINVAL;
+	} else {
+		filp->f_pos = cmd_offset + write_cmd_offset;
+		spin_lock(&file->pos_lock);
+		file->pos = -1;
+		spin_unlock(&file->pos_lock);
 	}
 
-	if (mutex_lock_interruptible(&dev->lock)){
-		return -ERESTARTSYS;
+    return retval;
+}
+
+/**
+ * Moves the file offset of @param filp to the stream offset asked for in
+ * @param arg, or the nearest byte kept, and reports the stream offsets of the
+ * history. The file offset is left anchored as by a read ending there, so the
+ * next read continues from that byte even if writes are evicted first.
+ * @return 0 on success, -EFAULT if @param arg cannot be accessed
+ */
+static long aesd_seek_stream(struct file *filp, struct aesd_stream __user *arg){
+    struct aesd_file *file = filp->private_data;
+    struct aesd_dev *dev = file->dev;
+	struct aesd_stream stream;
+	size_t start, end;
+	unsigned int seq;
+
+	if (copy_from_user(&stream, arg, sizeof(stream)) != 0){
+		return -EFAULT;
+	}
+
+	do {
+		seq = read_seqcount_begin(&dev->seq);
+		start = aesd_stream_start(&dev->c_buffer);
+		end = dev->c_buffer.end_offs;
+	} while (read_seqcount_retry(&dev->seq, seq));
+
+	stream.offset = clamp_t(u64, stream.offset, start, end);
+	stream.start = start;
+	stream.end = end;
+	PDEBUG("Seeking stream offset %llu of %zu to %zu", stream.offset, start, end);
+	aesd_stat_add(dev, AESD_STAT_SEEKS, 1);
+
+	spin_lock(&file->pos_lock);
+	filp->f_pos = stream.offset - start;
+	file->anchor = start;
+	file->pos = filp->f_pos;
+	spin_unlock(&file->pos_lock);
+
+	if (copy_to_user(arg, &stream, sizeof(stream)) != 0){
+		return -EFAULT;
+	}
+
+	return 0;
+}
+
+static long aesd_get_usage(struct file *filp, struct aesd_usage __user *arg){
+    struct aesd_dev *dev = ((struct aesd_file *)filp->private_data)->dev;
+	struct aesd_usage usage;
+	unsigned int seq;
+
+	do {
+		seq = read_seqcount_begin(&dev->seq);
+		usage.entries = aesd_circular_buffer_count(&dev->c_buffer);
+		usage.bytes = aesd_circular_buffer_size(&dev->c_buffer);
+	} while (read_seqcount_retry(&dev->seq, seq));
+	usage.max_entries = dev->c_buffer.capacity;
+	usage.max_bytes = dev->c_buffer.max_bytes;
+
+	if (copy_to_user(arg, &usage, sizeof(usage)) != 0){
+		return -EFAULT;
 	}
 
-	int i, cmd_offset = 0;
-	for (i = dev->c_buffer.out_offs; i < write_cmd + dev->c_buffer.out_offs; i++){
-		int curr_index = i % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+	return 0;
+}
+
+/**
+ * Lists the writes kept, oldest first, into the user table of @param arg in
+ * one snapshot of the descriptors, and reports how many writes there are.
+ * The table is built in a kernel copy first, as copying to user space may
+ * fault and must not happen inside the sequence count section.
+ */
+static long aesd_get_index(struct file *filp, struct aesd_index __user *arg){
+    struct aesd_dev *dev = ((struct aesd_file *)filp->private_data)->dev;
+	struct aesd_circular_buffer *buffer = &dev->c_buffer;
+	struct aesd_buffer_entry *entry;
+	struct aesd_index_entry *table = NULL;
+	struct aesd_index index;
+	size_t room, count, first, filled, offset;
+	unsigned int seq;
+	long retval = 0;
 
-		cmd_offset += dev->c_buffer.entry[curr_index].size;
+	if (copy_from_user(&index, arg, sizeof(index)) != 0){
+		return -EFAULT;
 	}
 
-	int cmd_index = (write_cmd + dev->c_buffer.out_offs)
-		% AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+	/* never more than capacity writes are kept */
+	room = min_t(u64, index.entries, buffer->capacity);
+	if (room > 0){
+		table = kvmalloc_array(room, sizeof(*table), GFP_KERNEL);
+		if (table == NULL){
+			return -ENOMEM;
+		}
+	}
+
+	do {
+		seq = read_seqcount_begin(&dev->seq);
+		count = aesd_circular_buffer_count(buffer);
+		first = buffer->added - count;
+		for (filled = 0; filled < min(count, room); filled++){
+			entry = aesd_circular_buffer_entry_at(buffer, filled, &offset);
+			if (entry == NULL){
+				/* torn snapshot, retried below */
+				break;
+			}
+			table[filled].seq = first + filled;
+			table[filled].offset = offset;
+			table[filled].size = entry->size;
+		}
+	} while (read_seqcount_retry(&dev->seq, seq));
+
+	PDEBUG("index of %zu writes, %zu listed", count, filled);
+
+	index.entries = count;
+	if (filled > 0 && copy_to_user(u64_to_user_ptr(index.table), table, filled * sizeof(*table)) != 0){
+		retval = -EFAULT;
+	} else if (copy_to_user(arg, &index, sizeof(index)) != 0){
+		retval = -EFAULT;
+	}
 
-	if (write_cmd_offset >= dev->c_buffer.entry[cmd_index].size){
+	kvfree(table);
+	return retval;
+}
+
+/**
+ * Copies consecutive writes, starting at sequence number seq of @param arg,
+ * into its user buffer without taking dev->lock. Only whole writes are
+ * copied, as many as fit and were asked for, in as few copies as
+ * aesd_read_span() allows. A seq past the newest write copies nothing.
+ * @return 0 on success, -EINVAL if the first write was already evicted or
+ * -EAGAIN if writes were evicted while being copied, in which case the
+ * caller may fetch a new index and retry
+ */
+static long aesd_read_cmds(struct file *filp, struct aesd_read_cmds __user *arg){
+    struct aesd_dev *dev = ((struct aesd_file *)filp->private_data)->dev;
+	struct aesd_circular_buffer *buffer = &dev->c_buffer;
+	struct aesd_buffer_entry *entry;
+	struct aesd_read_cmds req;
+	size_t count, first, cmds, len, offset, entry_offset, anchor, done, span_len, pos, oldest;
+	char __user *buf;
+	const char *span;
+	unsigned int seq;
+	long retval = 0;
+	int idx;
+
+	if (copy_from_user(&req, arg, sizeof(req)) != 0){
+		return -EFAULT;
+	}
+	buf = u64_to_user_ptr(req.buf);
+
+	do {
+		seq = read_seqcount_begin(&dev->seq);
+		count = aesd_circular_buffer_count(buffer);
+		first = buffer->added - count;
+		anchor = aesd_stream_start(buffer);
+		offset = 0;
+		cmds = 0;
+		len = 0;
+		while (cmds < req.cmds && req.seq >= first && req.seq - first + cmds < count){
+			entry = aesd_circular_buffer_entry_at(buffer, req.seq - first + cmds, &entry_offset);
+			if (entry == NULL || entry->size > req.len - len){
+				break;
+			}
+			if (cmds == 0){
+				offset = entry_offset;
+			}
+			len += entry->size;
+			cmds++;
+		}
+	} while (read_seqcount_retry(&dev->seq, seq));
+
+	if (req.seq < first){
 		return -EINVAL;
 	}
 
-	cmd_offset += write_cmd_offset;
-	filp->f_pos = cmd_offset;
+	PDEBUG("reading %zu writes from %llu, %zu bytes", cmds, req.seq, len);
 
-	mutex_unlock(&dev->lock);
+	idx = srcu_read_lock(&dev->srcu);
+	for (done = 0; done < len; done += span_len){
+		pos = anchor + offset + done;
+		span = aesd_read_span(dev, &pos, &oldest, false, len - done, &span_len);
+		if (span == NULL){
+			retval = -EAGAIN;
+			break;
+		}
+		if (copy_to_user(buf + done, span, span_len) != 0){
+			retval = -EFAULT;
+			break;
+		}
+		if (aesd_span_evicted(dev, pos)){
+			retval = -EAGAIN;
+			break;
+		}
+	}
+	srcu_read_unlock(&dev->srcu, idx);
 
-    return retval;
+	if (retval != 0){
+		return retval;
+	}
+
+	req.cmds = cmds;
+	req.len = len;
+	if (copy_to_user(arg, &req, sizeof(req)) != 0){
+		return -EFAULT;
+	}
+
+	return 0;
 }
 
 static long aesd_ioctl(struct file *filp, unsigned int cmd, unsigned long arg){
+	unsigned int minor = aesd_dev_minor(((struct aesd_file *)filp->private_data)->dev);
 	long retval = 0;
 
+	trace_aesd_ioctl_enter(minor, cmd);
     switch (cmd) {
         case AESDCHAR_IOCSEEKTO: {
 			struct aesd_seekto seekto;
@@ -217,24 +1251,265 @@ static long aesd_ioctl(struct file *filp, unsigned int cmd, unsigned long arg){
 
 			break;
 		}
+        case AESDCHAR_IOCGUSAGE:
+			retval = aesd_get_usage(filp, (struct aesd_usage __user *)arg);
+			break;
+        case AESDCHAR_IOCGINDEX:
+			retval = aesd_get_index(filp, (struct aesd_index __user *)arg);
+			break;
+        case AESDCHAR_IOCREADCMDS:
+			retval = aesd_read_cmds(filp, (struct aesd_read_cmds __user *)arg);
+			break;
+        case AESDCHAR_IOCSTAIL: {
+			u32 tail;
+
+			if (get_user(tail, (u32 __user *)arg)) {
+				retval = -EFAULT;
+			} else {
+				/* only reads through this open file wait, cat and other readers still see end of file */
+				WRITE_ONCE(((struct aesd_file *)filp->private_data)->tail, tail != 0);
+			}
+			break;
+		}
+        case AESDCHAR_IOCSEEKSTREAM:
+			retval = aesd_seek_stream(filp, (struct aesd_stream __user *)arg);
+			break;
+        default:
+			retval = -ENOTTY;
+			break;
 	}
+	trace_aesd_ioctl_exit(minor, cmd, retval);
 
 	return retval;
 }
 
+/**
+ * Readable while the history reaches past the stream offset the file position
+ * names, as the next read would see it, always writable. Woken on every write
+ * added to the history.
+ */
+static __poll_t aesd_poll(struct file *filp, struct poll_table_struct *wait)
+{
+	struct aesd_file *file = filp->private_data;
+	struct aesd_dev *dev = file->dev;
+	__poll_t mask = EPOLLOUT | EPOLLWRNORM;
+	size_t pos, start;
+
+	poll_wait(filp, &dev->readq, wait);
+
+	pos = aesd_read_begin(filp, filp->f_pos, &start, NULL);
+	if (pos < READ_ONCE(dev->c_buffer.end_offs)){
+		mask |= EPOLLIN | EPOLLRDNORM;
+	}
+
+	return mask;
+}
+
+/**
+ * Maps the header page(s) followed by the byte ring twice, read-only. Only the
+ * pages are shared, the layout never changes while the module is loaded, so
+ * this needs no lock.
+ */
+static int aesd_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	struct aesd_dev *dev = ((struct aesd_file *)filp->private_data)->dev;
+	size_t header_npages = dev->mmap_header_size >> PAGE_SHIFT;
+	size_t npages = (vma->vm_end - vma->vm_start) >> PAGE_SHIFT;
+	unsigned long addr = vma->vm_start;
+	struct page *page;
+	size_t index;
+	int err;
+
+	if (dev->mmap_header == NULL){
+		return -ENODEV;
+	}
+	if (vma->vm_flags & VM_WRITE){
+		return -EPERM;
+	}
+	if (vma->vm_pgoff != 0 || npages > header_npages + 2 * dev->ring_npages){
+		return -EINVAL;
+	}
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+	vm_flags_clear(vma, VM_MAYWRITE);
+#else
+	vma->vm_flags &= ~VM_MAYWRITE;
+#endif
+
+	for (index = 0; index < npages; index++, addr += PAGE_SIZE){
+		if (index < header_npages){
+			page = vmalloc_to_page((char *)dev->mmap_header + (index << PAGE_SHIFT));
+		} else {
+			page = dev->ring_pages[index - header_npages];
+		}
+		err = vm_insert_page(vma, addr, page);
+		if (err){
+			return err;
+		}
+	}
+
+	return 0;
+}
+
 struct file_operations aesd_fops = {
     .owner =    THIS_MODULE,
     .read =     aesd_read,
+    .read_iter = aesd_read_iter,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 5, 0)
+    .splice_read = copy_splice_read,
+#else
+    .splice_read = generic_file_splice_read,
+#endif
     .write =    aesd_write,
+    .write_iter = aesd_write_iter,
 	.llseek =	aesd_llseek,
     .open =     aesd_open,
     .release =  aesd_release,
 	.unlocked_ioctl = aesd_ioctl,
+	.mmap =		aesd_mmap,
+	.poll =		aesd_poll,
 };
 
-static int aesd_setup_cdev(struct aesd_dev *dev)
+/**
+ * Frees the byte ring and mapping header of @param dev, if any.
+ */
+static void aesd_free_ring(struct aesd_dev *dev)
 {
-    int err, devno = MKDEV(aesd_major, aesd_minor);
+	size_t index;
+
+	if (dev->c_buffer.ring != NULL){
+		vunmap(dev->c_buffer.ring);
+		dev->c_buffer.ring = NULL;
+	}
+	if (dev->ring_pages != NULL){
+		for (index = 0; index < dev->ring_npages && dev->ring_pages[index] != NULL; index++){
+			__free_page(dev->ring_pages[index]);
+		}
+		kvfree(dev->ring_pages);
+		dev->ring_pages = NULL;
+	}
+	vfree(dev->mmap_header);
+	dev->mmap_header = NULL;
+}
+
+/**
+ * Allocates a byte ring of at least @param size bytes for @param dev, its
+ * pages mapped twice in a row in the kernel as the circular buffer expects,
+ * and the header that describes it to aesd_mmap().
+ * @return 0 on success, -ENOMEM on failure
+ */
+static int aesd_alloc_ring(struct aesd_dev *dev, size_t size)
+{
+	struct aesd_circular_buffer *buffer = &dev->c_buffer;
+	size_t npages = PAGE_ALIGN(size) >> PAGE_SHIFT;
+	size_t index;
+	char *ring;
+
+	dev->ring_pages = kvcalloc(2 * npages, sizeof(*dev->ring_pages), GFP_KERNEL);
+	if (dev->ring_pages == NULL){
+		return -ENOMEM;
+	}
+	dev->ring_npages = npages;
+	for (index = 0; index < npages; index++){
+		dev->ring_pages[index] = alloc_page(GFP_KERNEL | __GFP_ZERO);
+		if (dev->ring_pages[index] == NULL){
+			goto fail;
+		}
+		dev->ring_pages[npages + index] = dev->ring_pages[index];
+	}
+
+	dev->mmap_header_size = PAGE_ALIGN(struct_size(dev->mmap_header, entry, buffer->capacity));
+	dev->mmap_header = vmalloc_user(dev->mmap_header_size);
+	if (dev->mmap_header == NULL){
+		goto fail;
+	}
+
+	ring = vmap(dev->ring_pages, 2 * npages, VM_MAP, PAGE_KERNEL);
+	if (ring == NULL || aesd_circular_buffer_init_ring(buffer, ring, npages << PAGE_SHIFT) != 0){
+		if (ring != NULL){
+			vunmap(ring);
+		}
+		goto fail;
+	}
+
+	dev->mmap_header->capacity = buffer->capacity;
+	dev->mmap_header->ring_offset = dev->mmap_header_size;
+	dev->mmap_header->ring_size = buffer->ring_size;
+
+	return 0;
+
+fail:
+	aesd_free_ring(dev);
+	return -ENOMEM;
+}
+
+/**
+ * Shows the counters of a device summed over all CPUs, its current memory
+ * use and the non-empty buckets of its latency histograms, each as the upper
+ * bound of the bucket in ns followed by the count.
+ */
+static int aesd_stats_show(struct seq_file *s, void *unused)
+{
+	struct aesd_dev *dev = s->private;
+	struct aesd_circular_buffer *buffer = &dev->c_buffer;
+	const struct aesd_stats *cpu_stats;
+	u64 count[AESD_NR_STATS] = {0};
+	u64 read_lat[AESD_LAT_BUCKETS] = {0};
+	u64 write_lat[AESD_LAT_BUCKETS] = {0};
+	size_t entries, bytes, memory;
+	unsigned int seq, index;
+	int cpu;
+
+	for_each_possible_cpu(cpu){
+		cpu_stats = per_cpu_ptr(dev->stats, cpu);
+		for (index = 0; index < AESD_NR_STATS; index++){
+			count[index] += cpu_stats->count[index];
+		}
+		for (index = 0; index < AESD_LAT_BUCKETS; index++){
+			read_lat[index] += cpu_stats->read_lat[index];
+			write_lat[index] += cpu_stats->write_lat[index];
+		}
+	}
+
+	do {
+		seq = read_seqcount_begin(&dev->seq);
+		entries = aesd_circular_buffer_count(buffer);
+		bytes = aesd_circular_buffer_size(buffer);
+	} while (read_seqcount_retry(&dev->seq, seq));
+
+	memory = buffer->capacity * (sizeof(*buffer->entry) + sizeof(*buffer->entry_start));
+	if (buffer->ring != NULL){
+		memory += (dev->ring_npages << PAGE_SHIFT) + dev->mmap_header_size;
+	} else {
+		memory += bytes + entries * sizeof(struct aesd_entry_buf);
+	}
+	/* commands being written, by open files or parked by closed ones */
+	memory += atomic_long_read(&dev->staging_bytes);
+
+	for (index = 0; index < AESD_NR_STATS; index++){
+		seq_printf(s, "%s %llu\n", aesd_stat_names[index], count[index]);
+	}
+	seq_printf(s, "entries %zu\nbytes %zu\nmemory_bytes %zu\n", entries, bytes, memory);
+
+	seq_puts(s, "read_latency_ns\n");
+	for (index = 0; index < AESD_LAT_BUCKETS; index++){
+		if (read_lat[index]){
+			seq_printf(s, "  %llu %llu\n", 1ULL << index, read_lat[index]);
+		}
+	}
+	seq_puts(s, "write_latency_ns\n");
+	for (index = 0; index < AESD_LAT_BUCKETS; index++){
+		if (write_lat[index]){
+			seq_printf(s, "  %llu %llu\n", 1ULL << index, write_lat[index]);
+		}
+	}
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(aesd_stats);
+
+static int aesd_setup_cdev(struct aesd_dev *dev, dev_t devno)
+{
+    int err;
 
     cdev_init(&dev->cdev, &aesd_fops);
     dev->cdev.owner = THIS_MODULE;
@@ -247,45 +1522,134 @@ static int aesd_setup_cdev(struct aesd_dev *dev)
 	return err;
 }
 
+/**
+ * Initializes the history, locks and ring of one device and makes it
+ * available as minor MINOR(devno).
+ * @return 0 on success or a negative error, with nothing left allocated
+ */
+static int aesd_setup_dev(struct aesd_dev *dev, dev_t devno)
+{
+    int result;
+
+    if (aesd_circular_buffer_init_capacity(&dev->c_buffer, max_entries) != 0) {
+        printk(KERN_WARNING "Can't allocate %lu entries for minor %u\n", max_entries, MINOR(devno));
+        return max_entries ? -ENOMEM : -EINVAL;
+    }
+	if (ring_bytes && aesd_alloc_ring(dev, ring_bytes) != 0) {
+        printk(KERN_WARNING "Can't allocate a ring of %lu bytes for minor %u\n", ring_bytes, MINOR(devno));
+        aesd_circular_buffer_free(&dev->c_buffer);
+        return -ENOMEM;
+    }
+	dev->stats = alloc_percpu(struct aesd_stats);
+	if (dev->stats == NULL) {
+        aesd_free_ring(dev);
+        aesd_circular_buffer_free(&dev->c_buffer);
+        return -ENOMEM;
+    }
+	result = init_srcu_struct(&dev->srcu);
+	if (result) {
+        free_percpu(dev->stats);
+        aesd_free_ring(dev);
+        aesd_circular_buffer_free(&dev->c_buffer);
+        return result;
+    }
+	dev->c_buffer.max_bytes = max_bytes;
+	atomic_long_set(&dev->staging_bytes, 0);
+	mutex_init(&dev->lock);
+	seqcount_mutex_init(&dev->seq, &dev->lock);
+	init_waitqueue_head(&dev->readq);
+
+    result = aesd_setup_cdev(dev, devno);
+
+    if( result ) {
+        cleanup_srcu_struct(&dev->srcu);
+        free_percpu(dev->stats);
+        aesd_free_ring(dev);
+        aesd_circular_buffer_free(&dev->c_buffer);
+    }
+
+    return result;
+}
+
+/**
+ * Removes one device set up by aesd_setup_dev() and frees everything it holds.
+ */
+static void aesd_teardown_dev(struct aesd_dev *dev)
+{
+	struct aesd_buffer_entry *entry;
+	size_t index;
+
+    cdev_del(&dev->cdev);
+
+	AESD_CIRCULAR_BUFFER_FOREACH(entry,&dev->c_buffer,index) {
+		aesd_release_entry(dev, entry->buffptr);
+	}
+	aesd_free_staging(dev, &dev->parked);
+	srcu_barrier(&dev->srcu);
+	cleanup_srcu_struct(&dev->srcu);
+	free_percpu(dev->stats);
+	aesd_free_ring(dev);
+	aesd_circular_buffer_free(&dev->c_buffer);
+}
+
 int aesd_init_module(void)
 {
     dev_t dev = 0;
     int result;
-    result = alloc_chrdev_region(&dev, aesd_minor, 1,
+	unsigned int index;
+	char name[16];
+
+	if (num_devices == 0) {
+        return -EINVAL;
+    }
+    result = alloc_chrdev_region(&dev, aesd_minor, num_devices,
             "aesdchar");
     aesd_major = MAJOR(dev);
     if (result < 0) {
         printk(KERN_WARNING "Can't get major %d\n", aesd_major);
         return result;
     }
-    memset(&aesd_device,0,sizeof(struct aesd_dev));
 
-    /**
-     * TODO: initialize the AESD specific portion of the device
-     */
-    aesd_circular_buffer_init(&aesd_device.c_buffer);
-	mutex_init(&aesd_device.lock);
+    aesd_devices = kcalloc(num_devices, sizeof(struct aesd_dev), GFP_KERNEL);
+    if (aesd_devices == NULL) {
+        unregister_chrdev_region(dev, num_devices);
+        return -ENOMEM;
+    }
 
-    result = aesd_setup_cdev(&aesd_device);
+	for (index = 0; index < num_devices; index++) {
+		result = aesd_setup_dev(&aesd_devices[index], MKDEV(aesd_major, aesd_minor + index));
+		if (result) {
+			while (index-- > 0) {
+				aesd_teardown_dev(&aesd_devices[index]);
+			}
+			kfree(aesd_devices);
+			unregister_chrdev_region(dev, num_devices);
+			return result;
+		}
+	}
 
-    if( result ) {
-        unregister_chrdev_region(dev, 1);
-    }
+	/* statistics are optional, debugfs failures are not checked */
+	aesd_debugfs = debugfs_create_dir("aesdchar", NULL);
+	for (index = 0; index < num_devices; index++) {
+		snprintf(name, sizeof(name), "stats%u", aesd_minor + index);
+		debugfs_create_file(name, 0444, aesd_debugfs, &aesd_devices[index], &aesd_stats_fops);
+	}
 
-    return result;
+    return 0;
 }
 
 void aesd_cleanup_module(void)
 {
     dev_t devno = MKDEV(aesd_major, aesd_minor);
+	unsigned int index;
 
-    cdev_del(&aesd_device.cdev);
-
-    /**
-     * TODO: cleanup AESD specific poritions here as necessary
-     */
+	debugfs_remove_recursive(aesd_debugfs);
+	for (index = 0; index < num_devices; index++) {
+		aesd_teardown_dev(&aesd_devices[index]);
+	}
+	kfree(aesd_devices);
 
-    unregister_chrdev_region(devno, 1);
+    unregister_chrdev_region(devno, num_devices);
 }
 
 
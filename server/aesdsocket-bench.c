@@ -0,0 +1,263 @@
+/*
+ * Contention benchmark for aesdsocket: many keep-alive clients append packets
+ * at once, each waiting for its own packet to come back before sending the
+ * next, so every request pays for the append serialization of the server.
+ * Run it against the same server started with -c mutex and with -c queue:
+ *
+ *   ./aesdsocket -m epoll -k -b 128 -c mutex &
+ *   ./aesdsocket-bench -c 64 -n 200
+ *
+ * Packets are plain appends and every reply is the whole history, so it runs
+ * against either backend. With /dev/aesdchar the history is bounded by the
+ * driver; load it with max_entries above the number of clients, or a packet
+ * may be evicted before its reply reads it and that client times out. The
+ * data file keeps growing instead, and with it every reply, so keep -n small
+ * there. Built with make bench.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#define RECV_BUF_SIZE (1 << 16)
+#define TAG_MAX_LEN 32
+#define RECV_TIMEOUT_S 5
+
+struct bench_config{
+	const char* addr;
+	int port;
+	int clients;
+	int requests;
+	size_t packet_size;
+};
+
+static struct bench_config config = {
+	.addr = "127.0.0.1",
+	.port = 9000,
+	.clients = 16,
+	.requests = 200,
+	.packet_size = 100
+};
+
+struct bench_client{
+	pthread_t thread;
+	int id;
+	/* microseconds from sending a packet to receiving it back */
+	uint32_t* latency_us;
+	int completed;
+};
+
+static pthread_barrier_t start_barrier;
+
+static long long now_us(void){
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000LL + now.tv_nsec / 1000;
+}
+
+static int send_all(int sockfd, const char* buffer, size_t size){
+	while (size > 0){
+		ssize_t bytes_sent = send(sockfd, buffer, size, MSG_NOSIGNAL);
+		if (bytes_sent < 0){
+			if (errno == EINTR){
+				continue;
+			}
+			return -1;
+		}
+		buffer += bytes_sent;
+		size -= bytes_sent;
+	}
+	return 0;
+}
+
+/*
+ * Receives until tag shows up in the stream. Replies carry the whole history,
+ * and the part of one after the tag is only read while looking for the next
+ * tag, which never shows up before its packet was sent. Only the last
+ * tag_len - 1 bytes are kept across receives in case the tag is split between
+ * them.
+ */
+static int recv_until(int sockfd, char* buffer, const char* tag, size_t tag_len){
+	size_t len = 0;
+
+	while (true){
+		ssize_t bytes_received = recv(sockfd, buffer + len, RECV_BUF_SIZE - len, 0);
+		if (bytes_received < 0 && errno == EINTR){
+			continue;
+		}
+		if (bytes_received <= 0){
+			return -1;
+		}
+		len += bytes_received;
+		if (memmem(buffer, len, tag, tag_len) != NULL){
+			return 0;
+		}
+		if (len >= tag_len){
+			memmove(buffer, buffer + len - (tag_len - 1), tag_len - 1);
+			len = tag_len - 1;
+		}
+	}
+}
+
+static int connect_server(void){
+	struct sockaddr_in addr = {
+		.sin_family = AF_INET,
+		.sin_port = htons(config.port)
+	};
+	if (inet_pton(AF_INET, config.addr, &addr.sin_addr) != 1){
+		fprintf(stderr, "Invalid address %s\n", config.addr);
+		return -1;
+	}
+
+	int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+	if (sockfd < 0){
+		perror("socket");
+		return -1;
+	}
+	int one = 1;
+	struct timeval timeout = { .tv_sec = RECV_TIMEOUT_S };
+	setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	/* a packet evicted from the device before its reply never comes back */
+	setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	if (connect(sockfd, (struct sockaddr*)&addr, sizeof(addr)) != 0){
+		perror("connect");
+		close(sockfd);
+		return -1;
+	}
+	return sockfd;
+}
+
+static void* client_thread(void* arg){
+	struct bench_client* client = arg;
+	char* packet = malloc(config.packet_size + TAG_MAX_LEN);
+	char* buffer = malloc(RECV_BUF_SIZE);
+	int sockfd = connect_server();
+
+	pthread_barrier_wait(&start_barrier);
+	if (packet == NULL || buffer == NULL || sockfd < 0){
+		goto out;
+	}
+
+	memset(packet, 'p', config.packet_size);
+	for (int i = 0; i < config.requests; i++){
+		char* tag = packet + config.packet_size;
+		int tag_len = snprintf(tag, TAG_MAX_LEN, "bench%d-%d\n", client->id, i);
+		long long start = now_us();
+		if (send_all(sockfd, packet, config.packet_size + tag_len) != 0 ||
+			recv_until(sockfd, buffer, tag, tag_len) != 0){
+			fprintf(stderr, "Client %d failed after %d requests\n", client->id, i);
+			break;
+		}
+		client->latency_us[i] = now_us() - start;
+		client->completed++;
+	}
+
+out:
+	if (sockfd >= 0){
+		close(sockfd);
+	}
+	free(buffer);
+	free(packet);
+	return client;
+}
+
+static int compare_u32(const void* a, const void* b){
+	uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+	return (x > y) - (x < y);
+}
+
+static void usage(const char* name){
+	fprintf(stderr, "Usage: %s [-a addr] [-p port] [-c clients] [-n requests] [-s size]\n"
+		"  -a addr       server address (default: 127.0.0.1)\n"
+		"  -p port       server port (default: 9000)\n"
+		"  -c clients    concurrent keep-alive connections (default: 16)\n"
+		"  -n requests   packets each client sends (default: 200)\n"
+		"  -s size       bytes of every packet before its tag (default: 100)\n",
+		name);
+}
+
+int main(int argc, char** argv){
+	int c;
+
+	while ((c = getopt(argc, argv, "a:p:c:n:s:")) != -1){
+		switch (c){
+			case 'a':
+				config.addr = optarg;
+				break;
+			case 'p':
+				config.port = atoi(optarg);
+				break;
+			case 'c':
+				config.clients = atoi(optarg);
+				break;
+			case 'n':
+				config.requests = atoi(optarg);
+				break;
+			case 's':
+				config.packet_size = strtoul(optarg, NULL, 10);
+				break;
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+	if (config.clients <= 0 || config.requests <= 0){
+		usage(argv[0]);
+		return 1;
+	}
+
+	struct bench_client* clients = calloc(config.clients, sizeof(struct bench_client));
+	uint32_t* latency_us = calloc((size_t)config.clients * config.requests, sizeof(uint32_t));
+	if (clients == NULL || latency_us == NULL){
+		fprintf(stderr, "Out of memory\n");
+		return 1;
+	}
+
+	pthread_barrier_init(&start_barrier, NULL, config.clients + 1);
+	for (int i = 0; i < config.clients; i++){
+		clients[i].id = i;
+		clients[i].latency_us = latency_us + (size_t)i * config.requests;
+		if (pthread_create(&clients[i].thread, NULL, client_thread, &clients[i]) != 0){
+			fprintf(stderr, "Failed to create client %d\n", i);
+			return 1;
+		}
+	}
+	pthread_barrier_wait(&start_barrier);
+	long long start = now_us();
+
+	size_t completed = 0;
+	for (int i = 0; i < config.clients; i++){
+		pthread_join(clients[i].thread, NULL);
+		/* compact the latencies of clients that stopped early */
+		memmove(latency_us + completed, clients[i].latency_us, clients[i].completed * sizeof(uint32_t));
+		completed += clients[i].completed;
+	}
+	long long elapsed_us = now_us() - start;
+	pthread_barrier_destroy(&start_barrier);
+
+	if (completed == 0){
+		fprintf(stderr, "No request completed\n");
+		return 1;
+	}
+	qsort(latency_us, completed, sizeof(uint32_t), compare_u32);
+	printf("%d clients, %zu requests of %zu bytes in %.3f s: %.0f requests/s, "
+		"latency p50 %u us p99 %u us max %u us\n",
+		config.clients, completed, config.packet_size, elapsed_us / 1e6,
+		completed * 1e6 / (elapsed_us ? elapsed_us : 1),
+		latency_us[completed / 2], latency_us[completed * 99 / 100], latency_us[completed - 1]);
+
+	free(latency_us);
+	free(clients);
+	return (completed == (size_t)config.clients * config.requests) ? 0 : 1;
+}
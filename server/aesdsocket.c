@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <time.h>
 #include <pthread.h> 
 #include <errno.h>
@@ -13,7 +14,20 @@
 #include <sys/socket.h>
 #include <sys/queue.h>
 #include <sys/ioctl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <poll.h>
+#include <limits.h>
+#include <linux/io_uring.h>
+#include <fcntl.h>
 #include <stdbool.h>
+#include <stdatomic.h>
+#include <stddef.h>
 #include "aesd_ioctl.h"
 
 #ifndef USE_AESD_CHAR_DEVICE
@@ -22,214 +36,3563 @@
 
 #if (USE_AESD_CHAR_DEVICE == 0)
 	#define FILENAME "/var/tmp/aesdsocketdata"
+	#define FILE_OPEN_FLAGS (O_RDWR | O_APPEND | O_CREAT)
 #else
 	#define FILENAME "/dev/aesdchar"
+	#define FILE_OPEN_FLAGS (O_RDWR | O_APPEND)
 #endif
 
+#define REACTOR_MAX_EVENTS 64
+#define DEFAULT_BACKLOG 5
+
+#define REPLY_CHUNK_SIZE 65536
+#define SEEKTO_MAX_LEN 64
+#define RECV_BUFFER_INITIAL_SIZE 4096
+#define RECV_BUFFER_MIN_FREE 1024
+#define RECV_BUFFER_POOL_MAX 64
+#define RECV_BUFFER_POOL_MAX_SIZE (1024 * 1024)
+#define MAX_REACTORS 1024
+#define COMMITTER_MAX_NOTIFY MAX_REACTORS
+#define DEFAULT_FLUSH_INTERVAL_MS 1000
+#define TAIL_POLL_MS 500
+#define DEFAULT_POOL_WORKERS 16
+#define POOL_LIMIT_PER_WORKER 4
+#define MAX_SHARDS 64
+
+#define URING_ENTRIES 256
+#define URING_BUF_COUNT 256
+#define URING_BUF_SIZE 4096
+#define URING_BUF_GROUP 0
+
+enum server_mode{
+	SERVER_MODE_THREAD,
+	SERVER_MODE_EPOLL,
+	SERVER_MODE_REUSEPORT,
+	SERVER_MODE_URING,
+};
+
+/*
+ * When a client gets its reply relative to its packet reaching the disk:
+ * per-request fsyncs every packet before replying, group batches concurrent
+ * packets into one fdatasync before replying, interval replies right away
+ * and syncs every flush_interval_ms, none never syncs.
+ */
+enum durability_policy{
+	DURABILITY_PER_REQUEST,
+	DURABILITY_GROUP,
+	DURABILITY_INTERVAL,
+	DURABILITY_NONE,
+};
+
+/*
+ * How appends are serialized: mutex takes the global lock around every
+ * write, queue pushes packets on a lock-free queue drained by the committer
+ * thread, which publishes how much of the file is completely written.
+ */
+enum concurrency_mode{
+	CONCURRENCY_MUTEX,
+	CONCURRENCY_QUEUE,
+};
+
+/*
+ * What the thread mode accept loop does once max_conns connections are
+ * admitted: pause leaves new connections in the listen backlog until a slot
+ * frees up, shed accepts and closes them right away.
+ */
+enum overload_policy{
+	OVERLOAD_PAUSE,
+	OVERLOAD_SHED,
+};
+
+struct server_config{
+	bool rundaemon;
+	enum server_mode mode;
+	int nworkers;
+	bool pin_cpus;
+	int backlog;
+	enum durability_policy durability;
+	int flush_interval_ms;
+	bool keepalive;
+	enum concurrency_mode concurrency;
+	int max_conns;
+	enum overload_policy overload;
+	int shards;
+};
+
+struct server_config config = {
+	.rundaemon = false,
+	.mode = SERVER_MODE_THREAD,
+	.nworkers = 0,
+	.pin_cpus = false,
+	.backlog = DEFAULT_BACKLOG,
+	.durability = DURABILITY_PER_REQUEST,
+	.flush_interval_ms = DEFAULT_FLUSH_INTERVAL_MS,
+	.keepalive = false,
+	.concurrency = CONCURRENCY_MUTEX,
+	.max_conns = 0,
+	.overload = OVERLOAD_PAUSE,
+	.shards = 1
+};
+
 bool signal_caught = false;
+bool stats_requested = false;
 pthread_mutex_t lock;
 
-struct conn_thread_data{
-    pthread_mutex_t* mutex;
-	int sockfd_in; 
-	struct sockaddr_in addr_client;
+/*
+ * With -D, connections are spread round robin over several aesdchar devices:
+ * FILENAME (minor 0), then FILENAME1 up to FILENAME<shards - 1>. Every device
+ * has its own append lock, so connections of different devices never contend.
+ */
+struct shard_table{
+	atomic_uint next;
+	pthread_mutex_t mutex[MAX_SHARDS];
+};
+
+struct shard_table shard_table = {
+	.next = 0
+};
+
+/*
+ * Receive buffer with newline framing. Bytes between start and len are
+ * received but not yet consumed as packets; the first scanned of them are
+ * known to contain no newline, so every byte is searched only once no matter
+ * how many recv calls a packet takes.
+ */
+struct recv_buffer{
+	char* data;
+	size_t size;
+	size_t start;
+	size_t scanned;
+	size_t len;
+};
+
+/*
+ * Buffers of finished connections are kept for reuse, so connections do not
+ * pay for growing a fresh buffer. Buffers grown above
+ * RECV_BUFFER_POOL_MAX_SIZE by a huge packet are freed instead.
+ */
+struct recv_buffer_pool{
+	pthread_mutex_t mutex;
+	char* data[RECV_BUFFER_POOL_MAX];
+	size_t size[RECV_BUFFER_POOL_MAX];
+	int count;
+};
+
+struct recv_buffer_pool recv_pool = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+	.count = 0
+};
+
+static int recv_buffer_acquire(struct recv_buffer* rb){
+	memset(rb, 0, sizeof(*rb));
+
+	pthread_mutex_lock(&recv_pool.mutex);
+	if (recv_pool.count > 0){
+		recv_pool.count--;
+		rb->data = recv_pool.data[recv_pool.count];
+		rb->size = recv_pool.size[recv_pool.count];
+	}
+	pthread_mutex_unlock(&recv_pool.mutex);
+
+	if (rb->data == NULL){
+		rb->data = malloc(RECV_BUFFER_INITIAL_SIZE);
+		if (rb->data == NULL){
+			return -1;
+		}
+		rb->size = RECV_BUFFER_INITIAL_SIZE;
+	}
+
+	return 0;
+}
+
+static void recv_buffer_release(struct recv_buffer* rb){
+	if (rb->data == NULL){
+		return;
+	}
+
+	pthread_mutex_lock(&recv_pool.mutex);
+	if (recv_pool.count < RECV_BUFFER_POOL_MAX && rb->size <= RECV_BUFFER_POOL_MAX_SIZE){
+		recv_pool.data[recv_pool.count] = rb->data;
+		recv_pool.size[recv_pool.count] = rb->size;
+		recv_pool.count++;
+		rb->data = NULL;
+	}
+	pthread_mutex_unlock(&recv_pool.mutex);
+
+	free(rb->data);
+	rb->data = NULL;
+}
+
+static void recv_buffer_drain_pool(void){
+	pthread_mutex_lock(&recv_pool.mutex);
+	while (recv_pool.count > 0){
+		free(recv_pool.data[--recv_pool.count]);
+	}
+	pthread_mutex_unlock(&recv_pool.mutex);
+}
+
+/*
+ * Makes room for at least min_free more bytes. Consumed packets are dropped
+ * from the front once they make up half of the buffer and the buffer doubles
+ * when it is still too small, so both cost amortized constant time per byte.
+ */
+static int recv_buffer_reserve(struct recv_buffer* rb, size_t min_free){
+	if (rb->size - rb->len >= min_free){
+		return 0;
+	}
+
+	if (rb->start > 0 && rb->start >= rb->len - rb->start){
+		memmove(rb->data, rb->data + rb->start, rb->len - rb->start);
+		rb->len -= rb->start;
+		rb->start = 0;
+		if (rb->size - rb->len >= min_free){
+			return 0;
+		}
+	}
+
+	size_t new_size = rb->size;
+	while (new_size - rb->len < min_free){
+		new_size *= 2;
+	}
+	char* new_data = realloc(rb->data, new_size);
+	if (new_data == NULL){
+		syslog(LOG_ERR, "Error growing receive buffer to %zu bytes\n", new_size);
+		return -1;
+	}
+	rb->data = new_data;
+	rb->size = new_size;
+
+	return 0;
+}
+
+/* Space recv() may fill, growing the buffer first when it is nearly full */
+static char* recv_buffer_tail(struct recv_buffer* rb, size_t* free_bytes){
+	if (recv_buffer_reserve(rb, RECV_BUFFER_MIN_FREE) != 0){
+		return NULL;
+	}
+	*free_bytes = rb->size - rb->len;
+
+	return rb->data + rb->len;
+}
+
+static void recv_buffer_commit(struct recv_buffer* rb, size_t bytes_received){
+	rb->len += bytes_received;
+}
+
+/*
+ * Frames the next newline terminated packet. Only bytes that arrived since the
+ * last call are searched. Returns false when no complete packet is buffered.
+ */
+static bool recv_buffer_next_packet(struct recv_buffer* rb, const char** packet, size_t* packet_len){
+	char* begin = rb->data + rb->start;
+	char* newline = memchr(begin + rb->scanned, '\n', rb->len - rb->start - rb->scanned);
+	if (newline == NULL){
+		rb->scanned = rb->len - rb->start;
+		return false;
+	}
+
+	*packet = begin;
+	*packet_len = newline - begin + 1;
+	rb->start += *packet_len;
+	rb->scanned = 0;
+
+	return true;
+}
+
+/* Hands out the unterminated rest once the peer closed its side */
+static bool recv_buffer_take_rest(struct recv_buffer* rb, const char** packet, size_t* packet_len){
+	if (rb->start == rb->len){
+		return false;
+	}
+
+	*packet = rb->data + rb->start;
+	*packet_len = rb->len - rb->start;
+	rb->start = rb->len;
+	rb->scanned = 0;
+
+	return true;
+}
+
+/*
+ * Checks the bytes received since the last scan for a newline. The scan
+ * position is left on the newline, so framing the packet does not search
+ * the same bytes again.
+ */
+static bool recv_buffer_has_packet(struct recv_buffer* rb){
+	char* begin = rb->data + rb->start;
+	char* newline = memchr(begin + rb->scanned, '\n', rb->len - rb->start - rb->scanned);
+	if (newline == NULL){
+		rb->scanned = rb->len - rb->start;
+		return false;
+	}
+	rb->scanned = newline - begin;
+
+	return true;
+}
+
+/*
+ * Progress of streaming the data file back to a client. The data is moved
+ * with sendfile (regular file) or spliced through pipefd (/dev/aesdchar) so
+ * it never enters user space; buff is only used when the file supports
+ * neither. pos tracks the file position while a reply is bounded by the
+ * published length of the queue concurrency mode.
+ */
+struct reply_stream{
+	int filefd;
+	int pipefd[2];
+	size_t pipe_pending;
+
+	bool started;
+	off_t pos;
+
+	bool copy;
+	char buff[1024];
+	size_t len;
+	size_t offs;
+};
+
+/*
+ * Thread mode serves connections from a fixed pool of worker threads. At most
+ * limit connections are admitted at a time, each either being served or
+ * waiting in the queue ring for a free worker. A worker keeps its connection
+ * until the client is done with it, keep-alive and tail included.
+ */
+struct conn_work{
+	int sockfd_in;
+	struct sockaddr_in addr_client;
+	long long queued_ms;
+};
+
+struct pool_worker{
+	pthread_t thread;
+	struct worker_pool* pool;
+	/* connection being served, -1 while idle */
+	int sockfd_in;
+};
+
+struct worker_pool{
+	pthread_mutex_t mutex;
+	pthread_cond_t work;
+	pthread_mutex_t* file_mutex;
+	bool stopping;
+
+	/* written by a worker freeing a slot while the accept loop is paused */
+	int slotfd;
+	bool paused;
+
+	struct pool_worker* workers;
+	int nworkers;
+	int started;
+
+	struct conn_work* queue;
+	int limit;
+	int queue_head;
+	int queue_len;
+	int inflight;
+	int busy;
+
+	unsigned long admitted;
+	unsigned long shed;
+	unsigned long pauses;
+	int queue_max;
+	/* connections taken off the queue by a worker, the ones wait_total_ms covers */
+	unsigned long dequeued;
+	long long wait_total_ms;
+	long long wait_max_ms;
+};
+
+/*
+ * Reply options of a connection. AESDSOCKET_READFROM:<offset> makes the reply
+ * start at a byte offset the client already has everything before, and every
+ * later reply continue where the previous one ended (delta) instead of
+ * resending the file from its start. AESDSOCKET_TAIL:<offset> does the same
+ * and then keeps pushing data as it is appended until the client closes.
+ *
+ * With /dev/aesdchar offsets are stream offsets, counting every byte written
+ * to the device since it was loaded (AESDCHAR_IOCSEEKSTREAM), as file offsets
+ * into the device would name other bytes once writes are evicted. A reply
+ * from an evicted offset starts at the oldest byte kept. With several devices
+ * an offset means nothing in the device the next connection gets, so both
+ * commands are refused and the connection is closed.
+ */
+struct conn_session{
+	bool delta;
+	bool tail;
+};
+
+/*
+ * State of a single connection served by the epoll reactor. A connection
+ * first collects bytes until a newline (CONN_RECV), then streams the data
+ * file back (CONN_SEND) as fast as the socket accepts it. Tailing
+ * connections stay in CONN_TAIL and are sent whatever gets appended.
+ */
+enum conn_state{
+	CONN_RECV,
+	CONN_WRITE,
+	CONN_COMMIT,
+	CONN_SEND,
+	CONN_TAIL,
+	CONN_DONE,
+};
+
+struct reactor_conn{
+	int sockfd_in;
+	struct sockaddr_in addr_client;
+	enum conn_state state;
+
+	struct recv_buffer rb;
+	bool eof;
+
+	struct reply_stream reply;
+	struct conn_session session;
+	/* append lock of the file the connection stores in */
+	pthread_mutex_t* mutex;
+
+	/* group commit ticket the reply waits for in CONN_COMMIT */
+	uint64_t ticket;
+	LIST_ENTRY(reactor_conn) commit_entries;
+
+	bool tailing;
+	uint64_t tail_seq;
+	LIST_ENTRY(reactor_conn) tail_entries;
+
+	/* io_uring backend only */
+	const char* packet;
+	size_t packet_len;
+	size_t write_offs;
+	off_t read_offs;
+	bool written;
+	bool stored;
+	/* a tailing connection's recv is in flight, the socket is closed */
+	bool watching;
+	bool closed;
+	/* polls of the device a tailing connection waits in, and their removal, in flight */
+	int polls;
+
+	LIST_ENTRY(reactor_conn) entries;
+};
+
+/*
+ * Operations submitted by the io_uring backend. The operation is stored in
+ * the low bits of the sqe user_data, the rest holds the connection (or the
+ * reactor for accept and wakeup requests), which are allocated and aligned
+ * to keep those bits clear.
+ */
+enum uring_op{
+	URING_OP_ACCEPT,
+	URING_OP_WAKE,
+	URING_OP_RECV,
+	URING_OP_WRITE,
+	URING_OP_FSYNC,
+	URING_OP_READ,
+	URING_OP_SEND,
+	URING_OP_CLOSE,
+	URING_OP_POLL,
+};
+
+#define URING_OP_MASK 0xFUL
+_Static_assert(_Alignof(max_align_t) > URING_OP_MASK, "connections from calloc must leave the operation bits clear");
+
+struct uring{
+	int ringfd;
+	unsigned sq_entries;
+	unsigned* sq_head;
+	unsigned* sq_tail;
+	unsigned* sq_mask;
+	unsigned* sq_array;
+	unsigned* cq_head;
+	unsigned* cq_tail;
+	unsigned* cq_mask;
+	struct io_uring_sqe* sqes;
+	struct io_uring_cqe* cqes;
+	void* ring_ptr;
+	size_t ring_size;
+	size_t sqes_size;
+	unsigned sq_local_tail;
+	unsigned to_submit;
+	unsigned inflight;
+
+	struct io_uring_buf_ring* buf_ring;
+	size_t buf_ring_size;
+	unsigned short buf_tail;
+	char* bufs;
+
+	int filefd;
+	eventfd_t wake_value;
+};
+
+struct reactor{
+	_Alignas(URING_OP_MASK + 1) int id;
+	int cpu;
+	int epfd;
+	int sockfd;
+	int wakefd;
+	struct uring* uring;
+	pthread_t thread;
+	pthread_mutex_t* mutex;
+	bool failed;
+	bool stopping;
+
+	atomic_ulong accepts;
+	atomic_ulong requests;
+
+	LIST_HEAD(conn_list_head, reactor_conn) conns;
+	LIST_HEAD(commit_list_head, reactor_conn) commits;
+	LIST_HEAD(tail_list_head, reactor_conn) tails;
+};
+
+static void signal_handler (int signal_number){
+    if (signal_number == SIGINT || signal_number == SIGTERM){
+        syslog(LOG_INFO, "Caught signal, exiting");
+		signal_caught = true;
+    }
+    if (signal_number == SIGUSR1){
+		stats_requested = true;
+    }
+}
+
+/*
+ * Tail subscriptions: everything appending to FILENAME bumps appends.seq.
+ * Connection threads tailing the file wait on appends.cond, reactors get
+ * their wakefd written. Appenders skip all of it while nobody tails, which
+ * with the aesdchar device is always: tails wait on the device itself, which
+ * also sees writes of other processes.
+ */
+struct append_notifier{
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	uint64_t seq;
+	atomic_int subscribers;
+
+	int wakefds[MAX_REACTORS];
+	int nwakefds;
+};
+
+struct append_notifier appends = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+	.seq = 0,
+	.nwakefds = 0
+};
+
+static void appends_register(int wakefd){
+	pthread_mutex_lock(&appends.mutex);
+	if (appends.nwakefds < MAX_REACTORS){
+		appends.wakefds[appends.nwakefds++] = wakefd;
+	}
+	pthread_mutex_unlock(&appends.mutex);
+}
+
+static void appends_unregister(int wakefd){
+	pthread_mutex_lock(&appends.mutex);
+	for (int i = 0; i < appends.nwakefds; i++){
+		if (appends.wakefds[i] == wakefd){
+			appends.wakefds[i] = appends.wakefds[--appends.nwakefds];
+			break;
+		}
+	}
+	pthread_mutex_unlock(&appends.mutex);
+}
+
+#if (USE_AESD_CHAR_DEVICE == 0)
+static void appends_subscribe(void){
+	atomic_fetch_add(&appends.subscribers, 1);
+}
+
+static void appends_unsubscribe(void){
+	atomic_fetch_sub(&appends.subscribers, 1);
+}
+#endif
+
+static void appends_notify(void){
+	if (atomic_load(&appends.subscribers) == 0){
+		return;
+	}
+
+	pthread_mutex_lock(&appends.mutex);
+	appends.seq++;
+	pthread_cond_broadcast(&appends.cond);
+	for (int i = 0; i < appends.nwakefds; i++){
+		eventfd_write(appends.wakefds[i], 1);
+	}
+	pthread_mutex_unlock(&appends.mutex);
+}
+
+static uint64_t appends_seq(void){
+	pthread_mutex_lock(&appends.mutex);
+	uint64_t seq = appends.seq;
+	pthread_mutex_unlock(&appends.mutex);
+
+	return seq;
+}
+
+#if (USE_AESD_CHAR_DEVICE == 0)
+/* Waits until something was appended after seq was read, or timeout_ms passed */
+static void appends_wait(uint64_t seq, int timeout_ms){
+	struct timespec deadline;
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += timeout_ms / 1000;
+	deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+	if (deadline.tv_nsec >= 1000000000L){
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000L;
+	}
+
+	pthread_mutex_lock(&appends.mutex);
+	while (appends.seq == seq &&
+		pthread_cond_timedwait(&appends.cond, &appends.mutex, &deadline) == 0);
+	pthread_mutex_unlock(&appends.mutex);
+}
+#endif
+
+/*
+ * Group commit: packets are appended to a shared batch and a single flusher
+ * thread writes the whole batch and issues one fdatasync for it. Every packet
+ * gets a ticket, and committer.durable_ticket tells which packets are on disk.
+ * Tickets of batches that failed to write are kept in committer.failed, so
+ * their waiters fail instead of replying. Reactors register their wakefd to be told when a batch became durable.
+ *
+ * In the queue concurrency mode packets are pushed on the lock-free stack
+ * committer.queue instead of the batch, and the committer thread is the only
+ * writer of the file. It publishes the length of the completely written
+ * part in committer.published_len, which bounds every reply.
+ */
+struct append_node{
+	struct append_node* next;
+	uint64_t ticket;
+	size_t len;
+	char data[];
+};
+
+/* Tickets first to last of one or more failed batches */
+struct committer_failure{
+	uint64_t first;
+	uint64_t last;
+};
+
+struct committer{
+	pthread_mutex_t mutex;
+	pthread_cond_t batch_cond;
+	pthread_cond_t durable_cond;
+	pthread_t thread;
+	int filefd;
+	bool stopping;
+	bool dirty;
+
+	struct iovec* batch;
+	size_t batch_len;
+	size_t batch_cap;
+
+	uint64_t next_ticket;
+	uint64_t durable_ticket;
+
+	struct committer_failure* failed;
+	size_t nfailed;
+	size_t failed_cap;
+
+	int notify_fds[COMMITTER_MAX_NOTIFY];
+	int nnotify;
+
+	_Atomic(struct append_node*) queue;
+	atomic_uint_fast64_t queue_ticket;
+	atomic_bool sleeping;
+	int wakefd;
+	atomic_llong published_len;
+};
+
+struct committer committer = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+	.batch_cond = PTHREAD_COND_INITIALIZER,
+	.durable_cond = PTHREAD_COND_INITIALIZER,
+	.filefd = -1,
+	.wakefd = -1
+};
+
+static bool committer_is_async(void){
+	return config.durability == DURABILITY_GROUP || config.durability == DURABILITY_INTERVAL ||
+		config.concurrency == CONCURRENCY_QUEUE;
+}
+
+/* Whether packets are handed to the committer instead of written by the connection */
+static bool committer_queues_packets(void){
+	return config.durability == DURABILITY_GROUP || config.concurrency == CONCURRENCY_QUEUE;
+}
+
+/* Length of the file replies may read up to, -1 when replies are unbounded */
+static off_t committer_published_len(void){
+#if (USE_AESD_CHAR_DEVICE == 0)
+	if (config.concurrency == CONCURRENCY_QUEUE){
+		return atomic_load_explicit(&committer.published_len, memory_order_acquire);
+	}
+#endif
+	return -1;
+}
+
+static void committer_notify_register(int wakefd){
+	pthread_mutex_lock(&committer.mutex);
+	if (committer.nnotify < COMMITTER_MAX_NOTIFY){
+		committer.notify_fds[committer.nnotify++] = wakefd;
+	}
+	pthread_mutex_unlock(&committer.mutex);
+}
+
+static void committer_notify_unregister(int wakefd){
+	pthread_mutex_lock(&committer.mutex);
+	for (int i = 0; i < committer.nnotify; i++){
+		if (committer.notify_fds[i] == wakefd){
+			committer.notify_fds[i] = committer.notify_fds[--committer.nnotify];
+			break;
+		}
+	}
+	pthread_mutex_unlock(&committer.mutex);
+}
+
+/*
+ * Lock-free submission of the queue concurrency mode. Tickets are taken
+ * before the push, so the stack can briefly miss a ticket of a producer that
+ * has not pushed yet; the committer writes strictly in ticket order and
+ * waits for such gaps to fill. The committer is only woken when it sleeps.
+ */
+static uint64_t committer_push(const char* buffer, size_t size){
+	struct append_node* node = malloc(sizeof(struct append_node) + size);
+	if (node == NULL){
+		return 0;
+	}
+	memcpy(node->data, buffer, size);
+	node->len = size;
+	uint64_t ticket = atomic_fetch_add(&committer.queue_ticket, 1) + 1;
+	node->ticket = ticket;
+
+	/* The node belongs to the committer once pushed */
+	node->next = atomic_load(&committer.queue);
+	while (!atomic_compare_exchange_weak(&committer.queue, &node->next, node));
+
+	if (atomic_exchange(&committer.sleeping, false)){
+		eventfd_write(committer.wakefd, 1);
+	}
+
+	return ticket;
+}
+
+/*
+ * Queues a copy of a packet for the next group commit batch and returns the
+ * ticket to wait for. Returns 0 on allocation failure.
+ */
+static uint64_t committer_append(const char* buffer, size_t size){
+	if (config.concurrency == CONCURRENCY_QUEUE){
+		return committer_push(buffer, size);
+	}
+
+	char* copy = malloc(size ? size : 1);
+	if (copy == NULL){
+		return 0;
+	}
+	memcpy(copy, buffer, size);
+
+	pthread_mutex_lock(&committer.mutex);
+	if (committer.batch_len == committer.batch_cap){
+		size_t new_cap = committer.batch_cap ? committer.batch_cap * 2 : 64;
+		struct iovec* new_batch = realloc(committer.batch, new_cap * sizeof(struct iovec));
+		if (new_batch == NULL){
+			pthread_mutex_unlock(&committer.mutex);
+			free(copy);
+			return 0;
+		}
+		committer.batch = new_batch;
+		committer.batch_cap = new_cap;
+	}
+	committer.batch[committer.batch_len].iov_base = copy;
+	committer.batch[committer.batch_len].iov_len = size;
+	committer.batch_len++;
+	uint64_t ticket = ++committer.next_ticket;
+	pthread_cond_signal(&committer.batch_cond);
+	pthread_mutex_unlock(&committer.mutex);
+
+	return ticket;
+}
+
+/*
+ * Called with committer.mutex held when writing the packets of tickets
+ * first to last failed. Without memory for another range the previous one
+ * is extended, which fails the tickets in between as well.
+ */
+static void committer_fail(uint64_t first, uint64_t last){
+	struct committer_failure* prev = committer.nfailed ? &committer.failed[committer.nfailed - 1] : NULL;
+
+	if (prev != NULL && prev->last + 1 >= first){
+		prev->last = last;
+		return;
+	}
+	if (committer.nfailed == committer.failed_cap){
+		size_t new_cap = committer.failed_cap ? committer.failed_cap * 2 : 16;
+		struct committer_failure* new_failed = realloc(committer.failed, new_cap * sizeof(struct committer_failure));
+		if (new_failed == NULL){
+			if (prev != NULL){
+				prev->last = last;
+			} else {
+				syslog(LOG_ERR, "Error recording failed packets %llu to %llu\n",
+					(unsigned long long)first, (unsigned long long)last);
+			}
+			return;
+		}
+		committer.failed = new_failed;
+		committer.failed_cap = new_cap;
+	}
+	committer.failed[committer.nfailed].first = first;
+	committer.failed[committer.nfailed].last = last;
+	committer.nfailed++;
+}
+
+/* Called with committer.mutex held. Ranges are in ticket order and recent tickets are looked up most */
+static int committer_ticket_result(uint64_t ticket){
+	if (committer.durable_ticket < ticket){
+		return 1;
+	}
+	for (size_t i = committer.nfailed; i > 0 && committer.failed[i - 1].last >= ticket; i--){
+		if (committer.failed[i - 1].first <= ticket){
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Returns 1 while the packet with this ticket is not on disk yet, 0 once it
+ * is and -1 when writing its batch failed.
+ */
+static int committer_result(uint64_t ticket){
+	pthread_mutex_lock(&committer.mutex);
+	int result = committer_ticket_result(ticket);
+	pthread_mutex_unlock(&committer.mutex);
+
+	return result;
+}
+
+/* Returns 0 once the packet with this ticket is on disk, -1 when writing it failed */
+static int committer_wait(uint64_t ticket){
+	int result;
+
+	pthread_mutex_lock(&committer.mutex);
+	while ((result = committer_ticket_result(ticket)) > 0){
+		pthread_cond_wait(&committer.durable_cond, &committer.mutex);
+	}
+	pthread_mutex_unlock(&committer.mutex);
+
+	return result;
+}
+
+/* Marks data written outside of the batch as needing the next interval sync */
+static void committer_mark_dirty(void){
+	pthread_mutex_lock(&committer.mutex);
+	committer.dirty = true;
+	pthread_mutex_unlock(&committer.mutex);
+}
+
+static int committer_write_batch(const struct iovec* batch, size_t batch_len){
+	size_t index = 0;
+
+	while (index < batch_len){
+		int iovcnt = (batch_len - index > IOV_MAX) ? IOV_MAX : (int)(batch_len - index);
+		ssize_t bytes_written = writev(committer.filefd, batch + index, iovcnt);
+		if (bytes_written < 0){
+			if (errno == EINTR){
+				continue;
+			}
+			syslog(LOG_ERR, "Error writing to file: %s\n", strerror(errno));
+			return -1;
+		}
+		while (index < batch_len && (size_t)bytes_written >= batch[index].iov_len){
+			bytes_written -= batch[index].iov_len;
+			index++;
+		}
+		/* Short write in the middle of a packet: finish that packet on its own */
+		size_t packet_offs = bytes_written;
+		while (packet_offs > 0 && packet_offs < batch[index].iov_len){
+			ssize_t rc = write(committer.filefd, (const char*)batch[index].iov_base + packet_offs,
+				batch[index].iov_len - packet_offs);
+			if (rc < 0){
+				if (errno == EINTR){
+					continue;
+				}
+				syslog(LOG_ERR, "Error writing to file: %s\n", strerror(errno));
+				return -1;
+			}
+			packet_offs += rc;
+		}
+		if (packet_offs > 0){
+			index++;
+		}
+	}
+
+	return 0;
+}
+
+static void committer_sync_interval(void){
+	struct timespec deadline;
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += config.flush_interval_ms / 1000;
+	deadline.tv_nsec += (config.flush_interval_ms % 1000) * 1000000L;
+	if (deadline.tv_nsec >= 1000000000L){
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000L;
+	}
+	while (!committer.stopping &&
+		pthread_cond_timedwait(&committer.batch_cond, &committer.mutex, &deadline) == 0);
+
+	bool dirty = committer.dirty;
+	committer.dirty = false;
+	pthread_mutex_unlock(&committer.mutex);
+	if (dirty){
+		fdatasync(committer.filefd);
+	}
+	pthread_mutex_lock(&committer.mutex);
+}
+
+static void* committer_thread(void* arg){
+	struct iovec* spare = NULL;
+	size_t spare_cap = 0;
+
+	pthread_mutex_lock(&committer.mutex);
+	while (!committer.stopping || committer.batch_len > 0){
+		if (config.durability == DURABILITY_INTERVAL){
+			committer_sync_interval();
+			continue;
+		}
+
+		if (committer.batch_len == 0){
+			pthread_cond_wait(&committer.batch_cond, &committer.mutex);
+			continue;
+		}
+
+		/* Take the whole batch; packets appended while flushing form the next one */
+		struct iovec* flushing = committer.batch;
+		size_t flushing_len = committer.batch_len;
+		size_t flushing_cap = committer.batch_cap;
+		uint64_t flushing_ticket = committer.next_ticket;
+		committer.batch = spare;
+		committer.batch_cap = spare_cap;
+		committer.batch_len = 0;
+		pthread_mutex_unlock(&committer.mutex);
+
+		int rc = committer_write_batch(flushing, flushing_len);
+		appends_notify();
+		if (fdatasync(committer.filefd) != 0){
+			syslog(LOG_DEBUG, "fdatasync: %s", strerror(errno));
+		}
+		for (size_t i = 0; i < flushing_len; i++){
+			free(flushing[i].iov_base);
+		}
+
+		pthread_mutex_lock(&committer.mutex);
+		spare = flushing;
+		spare_cap = flushing_cap;
+		if (rc != 0){
+			committer_fail(flushing_ticket - flushing_len + 1, flushing_ticket);
+		}
+		committer.durable_ticket = flushing_ticket;
+		pthread_cond_broadcast(&committer.durable_cond);
+		for (int i = 0; i < committer.nnotify; i++){
+			eventfd_write(committer.notify_fds[i], 1);
+		}
+	}
+	committer.durable_ticket = committer.next_ticket;
+	pthread_cond_broadcast(&committer.durable_cond);
+	pthread_mutex_unlock(&committer.mutex);
+
+	free(spare);
+	return arg;
+}
+
+/*
+ * Moves the nodes pushed since the last call to *pending, which stays sorted
+ * by ticket. The stack holds them newest first and is reversed; tickets out
+ * of order only come from producers racing between taking a ticket and
+ * pushing, so the insertion scan is rare.
+ */
+static void committer_queue_collect(struct append_node** pending){
+	struct append_node* pushed = atomic_exchange(&committer.queue, NULL);
+	struct append_node* reversed = NULL;
+	while (pushed != NULL){
+		struct append_node* next = pushed->next;
+		pushed->next = reversed;
+		reversed = pushed;
+		pushed = next;
+	}
+
+	struct append_node* last = *pending;
+	while (last != NULL && last->next != NULL){
+		last = last->next;
+	}
+	while (reversed != NULL){
+		struct append_node* node = reversed;
+		reversed = node->next;
+		if (last == NULL || last->ticket < node->ticket){
+			node->next = NULL;
+			if (last == NULL){
+				*pending = node;
+			} else {
+				last->next = node;
+			}
+			last = node;
+			continue;
+		}
+		struct append_node** pos = pending;
+		while ((*pos)->ticket < node->ticket){
+			pos = &(*pos)->next;
+		}
+		node->next = *pos;
+		*pos = node;
+	}
+}
+
+static long long committer_now_ms(void){
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000LL + now.tv_nsec / 1000000;
+}
+
+/*
+ * Committer of the queue concurrency mode. Every iteration writes the run of
+ * consecutive tickets that arrived with one writev, publishes the new file
+ * length and syncs according to the durability policy. Producers wake it
+ * through committer.wakefd only after it announced going to sleep.
+ */
+static void* committer_queue_thread(void* arg){
+	struct append_node* pending = NULL;
+	uint64_t next_ticket = 1;
+	struct iovec* iov = NULL;
+	size_t iov_cap = 0;
+	bool dirty = false;
+	long long last_sync_ms = committer_now_ms();
+
+	while (true){
+		committer_queue_collect(&pending);
+
+		size_t iov_len = 0;
+		off_t bytes = 0;
+		struct append_node* last = NULL;
+		for (struct append_node* node = pending; node != NULL && node->ticket == next_ticket; node = node->next){
+			if (iov_len == iov_cap){
+				size_t new_cap = iov_cap ? iov_cap * 2 : 64;
+				struct iovec* new_iov = realloc(iov, new_cap * sizeof(struct iovec));
+				if (new_iov == NULL){
+					break;
+				}
+				iov = new_iov;
+				iov_cap = new_cap;
+			}
+			iov[iov_len].iov_base = node->data;
+			iov[iov_len].iov_len = node->len;
+			iov_len++;
+			bytes += node->len;
+			next_ticket++;
+			last = node;
+		}
+
+		if (last != NULL){
+			struct append_node* run = pending;
+			pending = last->next;
+			last->next = NULL;
+
+			int rc = committer_write_batch(iov, iov_len);
+			if (rc == 0){
+				atomic_fetch_add_explicit(&committer.published_len, bytes, memory_order_release);
+			} else {
+				struct stat st;
+				if (fstat(committer.filefd, &st) == 0){
+					atomic_store_explicit(&committer.published_len, st.st_size, memory_order_release);
+				}
+			}
+			appends_notify();
+
+			if (config.durability == DURABILITY_PER_REQUEST || config.durability == DURABILITY_GROUP){
+				if (fdatasync(committer.filefd) != 0){
+					syslog(LOG_DEBUG, "fdatasync: %s", strerror(errno));
+				}
+			} else if (config.durability == DURABILITY_INTERVAL){
+				dirty = true;
+			}
+
+			pthread_mutex_lock(&committer.mutex);
+			if (rc != 0){
+				committer_fail(run->ticket, next_ticket - 1);
+			}
+			committer.durable_ticket = next_ticket - 1;
+			pthread_cond_broadcast(&committer.durable_cond);
+			for (int i = 0; i < committer.nnotify; i++){
+				eventfd_write(committer.notify_fds[i], 1);
+			}
+			pthread_mutex_unlock(&committer.mutex);
+
+			while (run != NULL){
+				struct append_node* next = run->next;
+				free(run);
+				run = next;
+			}
+		}
+
+		if (dirty && committer_now_ms() - last_sync_ms >= config.flush_interval_ms){
+			fdatasync(committer.filefd);
+			dirty = false;
+			last_sync_ms = committer_now_ms();
+		}
+		if (last != NULL){
+			continue;
+		}
+
+		pthread_mutex_lock(&committer.mutex);
+		bool stopping = committer.stopping;
+		pthread_mutex_unlock(&committer.mutex);
+		if (stopping && pending == NULL && atomic_load(&committer.queue) == NULL){
+			break;
+		}
+
+		/* Announce sleeping before the last look at the queue, see committer_push() */
+		atomic_store(&committer.sleeping, true);
+		if (atomic_load(&committer.queue) == NULL){
+			struct pollfd pfd = { .fd = committer.wakefd, .events = POLLIN };
+			if (poll(&pfd, 1, dirty ? config.flush_interval_ms : -1) > 0){
+				eventfd_t value;
+				eventfd_read(committer.wakefd, &value);
+			}
+		}
+		atomic_store(&committer.sleeping, false);
+	}
+
+	if (dirty){
+		fdatasync(committer.filefd);
+	}
+	free(iov);
+	return arg;
+}
+
+static int committer_start(void){
+	if (!committer_is_async()){
+		return 0;
+	}
+
+	committer.filefd = open(FILENAME, FILE_OPEN_FLAGS | O_CLOEXEC, 0644);
+	if (committer.filefd < 0){
+		syslog(LOG_ERR, "Error opening file for group commit: %s\n", strerror(errno));
+		return -1;
+	}
+
+	void* (*thread_fn)(void*) = committer_thread;
+	if (config.concurrency == CONCURRENCY_QUEUE){
+		struct stat st;
+		committer.wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (committer.wakefd < 0 || fstat(committer.filefd, &st) != 0){
+			syslog(LOG_ERR, "Error setting up the append queue: %s\n", strerror(errno));
+			if (committer.wakefd >= 0){
+				close(committer.wakefd);
+				committer.wakefd = -1;
+			}
+			close(committer.filefd);
+			committer.filefd = -1;
+			return -1;
+		}
+		atomic_store(&committer.published_len, st.st_size);
+		thread_fn = committer_queue_thread;
+	}
+
+	int rc = pthread_create(&committer.thread, NULL, thread_fn, NULL);
+	if (rc != 0){
+		syslog(LOG_ERR, "Failed to create the committer thread %d", rc);
+		close(committer.filefd);
+		committer.filefd = -1;
+		return -1;
+	}
+
+	return 0;
+}
+
+static void committer_stop(void){
+	if (committer.filefd < 0){
+		return;
+	}
+
+	pthread_mutex_lock(&committer.mutex);
+	committer.stopping = true;
+	pthread_cond_broadcast(&committer.batch_cond);
+	pthread_mutex_unlock(&committer.mutex);
+	if (committer.wakefd >= 0){
+		eventfd_write(committer.wakefd, 1);
+	}
+
+	pthread_join(committer.thread, NULL);
+	close(committer.filefd);
+	committer.filefd = -1;
+	if (committer.wakefd >= 0){
+		close(committer.wakefd);
+		committer.wakefd = -1;
+	}
+	free(committer.batch);
+	committer.batch = NULL;
+	free(committer.failed);
+	committer.failed = NULL;
+	committer.nfailed = 0;
+	committer.failed_cap = 0;
+}
+
+#if (USE_AESD_CHAR_DEVICE == 0)
+struct timer_thread_data{
+    pthread_mutex_t* mutex;
+
+	bool thread_complete;
+    bool thread_complete_success;
+};
+
+void timer_thread(union sigval timer_data){
+    struct timer_thread_data* thread_args = timer_data.sival_ptr;
+
+	time_t rawtime;
+	struct tm *info;
+	char buffer[80];
+
+	time( &rawtime );
+	info = localtime( &rawtime );
+	strftime(buffer, sizeof(buffer),"%F %T", info);
+
+	if (config.concurrency == CONCURRENCY_QUEUE){
+		char line[sizeof(buffer) + 16];
+		int len = snprintf(line, sizeof(line), "timestamp:%s\n", buffer);
+		thread_args->thread_complete = true;
+		thread_args->thread_complete_success = (committer_append(line, len) != 0);
+		return;
+	}
+
+	FILE* file = fopen(FILENAME, "a");
+	if (file == NULL){
+		syslog(LOG_ERR, "Error opening file for append: %s\n", strerror(errno));
+		thread_args->thread_complete = true;
+		thread_args->thread_complete_success = false;
+		return;
+	}
+
+	int rc;
+	rc = pthread_mutex_lock(thread_args->mutex);
+	if (rc != 0){
+		syslog(LOG_ERR, "Mutex lock failed to lock with %d\n", rc);
+		thread_args->thread_complete = true;
+		thread_args->thread_complete_success = false;
+		return;
+	}
+	if (fprintf(file, "timestamp:%s\n", buffer) < 0){
+		syslog(LOG_ERR, "Error writing to file: %s\n", strerror(errno));
+		thread_args->thread_complete = true;
+		thread_args->thread_complete_success = false;
+		return;
+	}
+	if (fclose(file) == EOF){
+		syslog(LOG_ERR, "Error closing the file: %s\n", strerror(errno));
+		thread_args->thread_complete = true;
+		thread_args->thread_complete_success = false;
+		return;
+	}
+	appends_notify();
+	rc = pthread_mutex_unlock(thread_args->mutex);
+	if (rc != 0){
+		syslog(LOG_ERR, "Mutex unlock failed to lock with %d\n", rc);
+		thread_args->thread_complete = true;
+		thread_args->thread_complete_success = false;
+		return;
+	}
+
+	thread_args->thread_complete = true;
+	thread_args->thread_complete_success = true;
+}
+#endif
+
+static bool is_command_packet(const char* buffer, size_t size, const char* command){
+	return size >= strlen(command) && strncmp(buffer, command, strlen(command)) == 0;
+}
+
+static bool is_seekto_packet(const char* buffer, size_t size){
+	return is_command_packet(buffer, size, "AESDCHAR_IOCSEEKTO:");
+}
+
+/* Packets that only change where the reply starts, nothing is stored */
+static bool is_control_packet(const char* buffer, size_t size){
+	return is_seekto_packet(buffer, size) ||
+		is_command_packet(buffer, size, "AESDSOCKET_READFROM:") ||
+		is_command_packet(buffer, size, "AESDSOCKET_TAIL:");
+}
+
+/* Returns -1 when the command is not supported, see struct conn_session */
+static int process_readfrom(int filefd, const char* buffer, size_t size, struct conn_session* session){
+	char command[SEEKTO_MAX_LEN + 1];
+	size_t command_len = (size > SEEKTO_MAX_LEN) ? SEEKTO_MAX_LEN : size;
+	memcpy(command, buffer, command_len);
+	command[command_len] = '\0';
+
+	syslog(LOG_DEBUG, "Command received %s", command);
+	if (config.shards > 1){
+		syslog(LOG_ERR, "%s is not supported with several devices\n", command);
+		return -1;
+	}
+	bool tail = is_command_packet(buffer, size, "AESDSOCKET_TAIL:");
+	long long offset;
+	if (sscanf(command, tail ? "AESDSOCKET_TAIL:%lld" : "AESDSOCKET_READFROM:%lld", &offset) != 1 || offset < 0){
+		return 0;
+	}
+#if (USE_AESD_CHAR_DEVICE == 1)
+	struct aesd_stream stream = { .offset = offset };
+	if (ioctl(filefd, AESDCHAR_IOCSEEKSTREAM, &stream) != 0){
+		syslog(LOG_ERR, "Cannot read from stream offset %lld of %s: %s\n", offset, FILENAME, strerror(errno));
+		return -1;
+	}
+	if (stream.offset != (uint64_t)offset){
+		syslog(LOG_DEBUG, "Reading from stream offset %llu instead of %lld", (unsigned long long)stream.offset, offset);
+	}
+#else
+	if (lseek(filefd, offset, SEEK_SET) < 0){
+		syslog(LOG_DEBUG, "Cannot read from offset %lld: %s", offset, strerror(errno));
+	}
+#endif
+	session->delta = true;
+	session->tail = session->tail || tail;
+
+	return 0;
+}
+
+static void process_seekto(int filefd, const char* buffer, size_t size){
+	char command[SEEKTO_MAX_LEN + 1];
+	size_t command_len = (size > SEEKTO_MAX_LEN) ? SEEKTO_MAX_LEN : size;
+	memcpy(command, buffer, command_len);
+	command[command_len] = '\0';
+
+	syslog(LOG_DEBUG, "IOCTL received %s", command);
+	unsigned int write_cmd, write_cmd_offset;
+	if (sscanf(command, "AESDCHAR_IOCSEEKTO:%u,%u", &write_cmd, &write_cmd_offset) == 2) {
+		struct aesd_seekto seekto;
+		seekto.write_cmd = write_cmd;
+		seekto.write_cmd_offset = write_cmd_offset;
+
+		ioctl(filefd, AESDCHAR_IOCSEEKTO, &seekto);
+	}
+}
+
+/*
+ * Appends to FILENAME through filefd. The aesdchar device stores every write
+ * at the end whatever the offset, so there pwrite leaves the file position,
+ * which a delta reply continues from, and the stream offset it stands for alone.
+ */
+static ssize_t append_write(int filefd, const char* buffer, size_t size){
+#if (USE_AESD_CHAR_DEVICE == 1)
+	return pwrite(filefd, buffer, size, 0);
+#else
+	return write(filefd, buffer, size);
+#endif
+}
+
+/*
+ * Stores a received packet in FILENAME, or for an AESDCHAR_IOCSEEKTO command
+ * moves the file position of filefd to the requested write command instead.
+ * AESDSOCKET_READFROM and AESDSOCKET_TAIL commands update the session. On success filefd is positioned where the reply should be streamed from:
+ * the start of the file, or for delta sessions where the last reply ended.
+ * With group commit the packet is only queued, and *ticket is set to the
+ * ticket to wait for before replying (0 when the reply can go out at once).
+ */
+static int process_packet(int filefd, const char* buffer, size_t size, struct conn_session* session,
+	pthread_mutex_t* mutex, uint64_t* ticket){
+	int rc;
+
+	*ticket = 0;
+
+	if (is_control_packet(buffer, size) && !is_seekto_packet(buffer, size)){
+		return process_readfrom(filefd, buffer, size, session);
+	}
+
+	bool seekto = is_seekto_packet(buffer, size);
+	if (seekto && config.concurrency == CONCURRENCY_QUEUE){
+		process_seekto(filefd, buffer, size);
+		return 0;
+	}
+	if (!seekto && committer_queues_packets()){
+		syslog(LOG_DEBUG, "Queueing %zu bytes for group commit", size);
+		*ticket = committer_append(buffer, size);
+		if (*ticket == 0){
+			syslog(LOG_ERR, "Error queueing packet of %zu bytes for group commit\n", size);
+			return -1;
+		}
+		if (!session->delta){
+			lseek(filefd, 0, SEEK_SET);
+		}
+		return 0;
+	}
+
+	rc = pthread_mutex_lock(mutex);
+	if (rc != 0){
+		syslog(LOG_ERR, "Mutex lock failed to lock with %d", rc);
+		return -1;
+	}
+
+	if (seekto) {
+		process_seekto(filefd, buffer, size);
+	} else {
+		syslog(LOG_DEBUG, "Writing %zu bytes to file", size);
+		bool keep_offs = session->delta && USE_AESD_CHAR_DEVICE == 0;
+		off_t reply_offs = keep_offs ? lseek(filefd, 0, SEEK_CUR) : 0;
+		size_t bytes_written = 0;
+		while (bytes_written < size){
+			ssize_t rc_write = append_write(filefd, buffer + bytes_written, size - bytes_written);
+			if (rc_write < 0){
+				if (errno == EINTR){
+					continue;
+				}
+				syslog(LOG_ERR, "Error writing to file: %s\n", strerror(errno));
+				pthread_mutex_unlock(mutex);
+				return -1;
+			}
+			bytes_written += rc_write;
+		}
+
+		if (config.durability == DURABILITY_PER_REQUEST){
+			fsync(filefd);
+		} else if (config.durability == DURABILITY_INTERVAL){
+			committer_mark_dirty();
+		}
+		appends_notify();
+		if (keep_offs || !session->delta){
+			lseek(filefd, reply_offs, SEEK_SET);
+		}
+	}
+
+	rc = pthread_mutex_unlock(mutex);
+	if (rc != 0){
+		syslog(LOG_ERR, "Mutex unlock failed to unlock with %d", rc);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Stores up to max_packets complete packets buffered in rb, and once the peer
+ * closed its side (eof) the unterminated rest as well. *ticket is set to the
+ * group commit ticket of the last queued packet, 0 if none has to be waited
+ * for. Returns the number of packets processed or -1 on error.
+ */
+static int process_packets(int filefd, struct recv_buffer* rb, bool eof, int max_packets,
+	struct conn_session* session, pthread_mutex_t* mutex, uint64_t* ticket){
+	const char* packet;
+	size_t packet_len;
+	int npackets = 0;
+
+	*ticket = 0;
+	while (npackets < max_packets && (recv_buffer_next_packet(rb, &packet, &packet_len) ||
+		(eof && recv_buffer_take_rest(rb, &packet, &packet_len)))){
+		uint64_t packet_ticket;
+		if (process_packet(filefd, packet, packet_len, session, mutex, &packet_ticket) != 0){
+			return -1;
+		}
+		if (packet_ticket != 0){
+			*ticket = packet_ticket;
+		}
+		npackets++;
+	}
+
+	return npackets;
+}
+
+static void reply_stream_init(struct reply_stream* reply, int filefd){
+	memset(reply, 0, sizeof(*reply));
+	reply->filefd = filefd;
+	reply->pipefd[0] = -1;
+	reply->pipefd[1] = -1;
+}
+
+static void reply_stream_close(struct reply_stream* reply){
+	if (reply->filefd >= 0){
+		close(reply->filefd);
+		reply->filefd = -1;
+	}
+	if (reply->pipefd[0] >= 0){
+		close(reply->pipefd[0]);
+		close(reply->pipefd[1]);
+		reply->pipefd[0] = -1;
+		reply->pipefd[1] = -1;
+	}
+}
+
+/*
+ * Returns how many bytes the reply may still send from the current position
+ * (at most max), 0 once it reached the published length.
+ */
+static size_t reply_stream_budget(struct reply_stream* reply, size_t max){
+	off_t published = committer_published_len();
+	if (published < 0){
+		return max;
+	}
+	if (!reply->started){
+		reply->pos = lseek(reply->filefd, 0, SEEK_CUR);
+		reply->started = true;
+	}
+	if (reply->pos >= published){
+		reply->started = false;
+		return 0;
+	}
+
+	return (published - reply->pos < (off_t)max) ? (size_t)(published - reply->pos) : max;
+}
+
+static int reply_stream_send_copy(struct reply_stream* reply, int sockfd){
+	while (true){
+		if (reply->offs == reply->len){
+			size_t count = reply_stream_budget(reply, sizeof(reply->buff));
+			if (count == 0){
+				return 1;
+			}
+			ssize_t bytes_read = read(reply->filefd, reply->buff, count);
+			if (bytes_read < 0){
+				if (errno == EINTR){
+					continue;
+				}
+				syslog(LOG_ERR, "Error reading from file: %s\n", strerror(errno));
+				return -1;
+			}
+			if (bytes_read == 0){
+				reply->started = false;
+				return 1;
+			}
+			reply->pos += bytes_read;
+			reply->len = bytes_read;
+			reply->offs = 0;
+		}
+
+		ssize_t bytes_sent = send(sockfd, reply->buff + reply->offs, reply->len - reply->offs, MSG_NOSIGNAL);
+		if (bytes_sent < 0){
+			if (errno == EAGAIN || errno == EWOULDBLOCK){
+				return 0;
+			}
+			if (errno == EINTR){
+				continue;
+			}
+			syslog(LOG_ERR, "Error sending data: %s\n", strerror(errno));
+			return -1;
+		}
+		reply->offs += bytes_sent;
+	}
+}
+
+/*
+ * Sends the data file from its current position to the end. Returns 1 once
+ * everything was sent, 0 if a non-blocking socket is full and -1 on error.
+ */
+static int reply_stream_send(struct reply_stream* reply, int sockfd){
+	while (!reply->copy){
+#if (USE_AESD_CHAR_DEVICE == 0)
+		size_t count = reply_stream_budget(reply, REPLY_CHUNK_SIZE);
+		if (count == 0){
+			return 1;
+		}
+		ssize_t bytes_sent = sendfile(sockfd, reply->filefd, NULL, count);
+		if (bytes_sent < 0){
+			if (errno == EAGAIN || errno == EWOULDBLOCK){
+				return 0;
+			}
+			if (errno == EINTR){
+				continue;
+			}
+			if (errno == EINVAL || errno == ENOSYS){
+				reply->copy = true;
+				break;
+			}
+			syslog(LOG_ERR, "Error sending data: %s\n", strerror(errno));
+			return -1;
+		}
+		if (bytes_sent == 0){
+			reply->started = false;
+			return 1;
+		}
+		reply->pos += bytes_sent;
+#else
+		if (reply->pipefd[0] < 0 && pipe2(reply->pipefd, O_CLOEXEC) != 0){
+			reply->copy = true;
+			break;
+		}
+		if (reply->pipe_pending == 0){
+			ssize_t bytes_spliced = splice(reply->filefd, NULL, reply->pipefd[1], NULL,
+				REPLY_CHUNK_SIZE, SPLICE_F_MOVE);
+			if (bytes_spliced < 0){
+				if (errno == EINTR){
+					continue;
+				}
+				if (errno == EINVAL || errno == ENOSYS){
+					reply->copy = true;
+					break;
+				}
+				syslog(LOG_ERR, "Error reading from file: %s\n", strerror(errno));
+				return -1;
+			}
+			if (bytes_spliced == 0){
+				return 1;
+			}
+			reply->pipe_pending = bytes_spliced;
+		}
+
+		ssize_t bytes_sent = splice(reply->pipefd[0], NULL, sockfd, NULL,
+			reply->pipe_pending, SPLICE_F_MOVE);
+		if (bytes_sent < 0){
+			if (errno == EAGAIN || errno == EWOULDBLOCK){
+				return 0;
+			}
+			if (errno == EINTR){
+				continue;
+			}
+			syslog(LOG_ERR, "Error sending data: %s\n", strerror(errno));
+			return -1;
+		}
+		reply->pipe_pending -= bytes_sent;
+#endif
+	}
+
+	return reply_stream_send_copy(reply, sockfd);
+}
+
+/*
+ * Without keep-alive a connection sends its packets, gets one reply and is
+ * closed. With keep-alive every packet is answered on its own, in order,
+ * and the connection stays open until the client closes it.
+ */
+static int packets_per_reply(void){
+	return config.keepalive ? 1 : INT_MAX;
+}
+
+/*
+ * Receives until rb holds a complete packet or the peer closed its side
+ * (*eof). Returns -1 on error or when the server is shutting down.
+ */
+static int conn_recv_packet(int sockfd, struct recv_buffer* rb, bool* eof){
+	while (!*eof && !recv_buffer_has_packet(rb)){
+		size_t free_bytes;
+		char* tail = recv_buffer_tail(rb, &free_bytes);
+		if (tail == NULL || signal_caught){
+			return -1;
+		}
+
+		ssize_t bytes_received = recv(sockfd, tail, free_bytes, 0);
+		if (signal_caught){
+			return -1;
+		}
+		if (bytes_received < 0){
+			if (errno == EINTR){
+				continue;
+			}
+			syslog(LOG_ERR, "Error receiving data: %s\n", strerror(errno));
+			return -1;
+		}
+		if (bytes_received == 0){
+			*eof = true;
+			break;
+		}
+		recv_buffer_commit(rb, bytes_received);
+
+		if (recv_buffer_has_packet(rb)){
+			syslog(LOG_DEBUG, "Newline found after %zu bytes", rb->len);
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Drains what a tailing client sent, which is ignored. Returns true once the
+ * client closed the connection or it failed.
+ */
+static bool conn_peer_closed(int sockfd){
+	char discard[256];
+
+	while (true){
+		ssize_t bytes_received = recv(sockfd, discard, sizeof(discard), MSG_DONTWAIT);
+		if (bytes_received > 0){
+			continue;
+		}
+		if (bytes_received < 0 && errno == EINTR){
+			continue;
+		}
+		return bytes_received == 0 || (errno != EAGAIN && errno != EWOULDBLOCK);
+	}
+}
+
+/*
+ * Waits up to TAIL_POLL_MS for something to send to a tailing client, or for
+ * it to send or close. The aesdchar device is readable once anyone wrote past
+ * the reply; appends to the data file are only known from appends, by seq.
+ */
+static int conn_tail_wait(int sockfd, int filefd, uint64_t seq){
+#if (USE_AESD_CHAR_DEVICE == 1)
+	struct pollfd fds[2] = {
+		{ .fd = filefd, .events = POLLIN },
+		{ .fd = sockfd, .events = POLLIN }
+	};
+	if (poll(fds, 2, TAIL_POLL_MS) < 0 && errno != EINTR){
+		syslog(LOG_ERR, "Error polling %s: %s\n", FILENAME, strerror(errno));
+		return -1;
+	}
+#else
+	appends_wait(seq, TAIL_POLL_MS);
+#endif
+	return 0;
+}
+
+/*
+ * Pushes data appended to the file to a tailing client until it closes the
+ * connection or the server shuts down.
+ */
+static int conn_tail(int sockfd, struct reply_stream* reply){
+	int rc = 0;
+
+#if (USE_AESD_CHAR_DEVICE == 0)
+	appends_subscribe();
+#endif
+	while (!signal_caught){
+		uint64_t seq = appends_seq();
+		while ((rc = reply_stream_send(reply, sockfd)) == 0);
+		if (rc < 0 || conn_peer_closed(sockfd)){
+			break;
+		}
+		if (conn_tail_wait(sockfd, reply->filefd, seq) != 0){
+			rc = -1;
+			break;
+		}
+	}
+#if (USE_AESD_CHAR_DEVICE == 0)
+	appends_unsubscribe();
+#endif
+
+	return (rc < 0) ? -1 : 0;
+}
+
+/*
+ * Opens the file a new connection stores its packets in and replies from.
+ * With several shards this is the next device in turn, and *mutex is set to
+ * that device's append lock.
+ */
+static int open_conn_file(pthread_mutex_t** mutex){
+	if (config.shards <= 1){
+		return open(FILENAME, FILE_OPEN_FLAGS, 0644);
+	}
+
+	unsigned int shard = atomic_fetch_add_explicit(&shard_table.next, 1, memory_order_relaxed) % config.shards;
+	char path[sizeof(FILENAME) + 16];
+	if (shard == 0){
+		snprintf(path, sizeof(path), "%s", FILENAME);
+	} else {
+		snprintf(path, sizeof(path), "%s%u", FILENAME, shard);
+	}
+	*mutex = &shard_table.mutex[shard];
+
+	return open(path, FILE_OPEN_FLAGS, 0644);
+}
+
+/*
+ * Serves one connection of the thread mode until it is done. The socket is
+ * left open for the caller. Returns true when the connection ended cleanly.
+ */
+static bool serve_conn(int sockfd_in, pthread_mutex_t* mutex){
+	bool success = false;
+
+	struct recv_buffer rb;
+	if (recv_buffer_acquire(&rb) != 0){
+		syslog(LOG_ERR, "Error allocating receive buffer\n");
+		return false;
+	}
+
+	int filefd = open_conn_file(&mutex);
+	if (filefd < 0){
+		syslog(LOG_ERR, "Error opening file for read/write: %s\n", strerror(errno));
+		recv_buffer_release(&rb);
+		return false;
+	}
+
+	struct reply_stream reply;
+	reply_stream_init(&reply, filefd);
+
+	struct conn_session session = { .delta = false, .tail = false };
+	bool eof = false;
+	while (conn_recv_packet(sockfd_in, &rb, &eof) == 0){
+		uint64_t ticket;
+		int npackets = process_packets(filefd, &rb, eof, packets_per_reply(), &session,
+			mutex, &ticket);
+		if (npackets < 0){
+			break;
+		}
+		if (npackets == 0 && config.keepalive){
+			success = true;
+			break;
+		}
+		if (ticket != 0 && committer_wait(ticket) != 0){
+			break;
+		}
+
+		int rc;
+		while ((rc = reply_stream_send(&reply, sockfd_in)) == 0);
+		if (rc < 0){
+			break;
+		}
+		if (session.tail){
+			success = (conn_tail(sockfd_in, &reply) == 0);
+			break;
+		}
+		if (!config.keepalive){
+			success = true;
+			break;
+		}
+	}
+
+	reply_stream_close(&reply);
+	recv_buffer_release(&rb);
+
+	return success;
+}
+
+static int set_nonblocking(int fd){
+	int flags = fcntl(fd, F_GETFL, 0);
+	if (flags < 0){
+		return -1;
+	}
+
+	return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+static void reactor_conn_close(struct reactor* reactor, struct reactor_conn* conn){
+	if (conn->state == CONN_COMMIT){
+		LIST_REMOVE(conn, commit_entries);
+	}
+	if (conn->tailing){
+		LIST_REMOVE(conn, tail_entries);
+#if (USE_AESD_CHAR_DEVICE == 1)
+		epoll_ctl(reactor->epfd, EPOLL_CTL_DEL, conn->reply.filefd, NULL);
+#else
+		appends_unsubscribe();
+#endif
+	}
+	epoll_ctl(reactor->epfd, EPOLL_CTL_DEL, conn->sockfd_in, NULL);
+	close(conn->sockfd_in);
+	reply_stream_close(&conn->reply);
+	syslog(LOG_INFO, "Closed connection from %s\n", inet_ntoa(conn->addr_client.sin_addr));
+
+	LIST_REMOVE(conn, entries);
+	recv_buffer_release(&conn->rb);
+	free(conn);
+}
+
+/*
+ * Called once a full packet has been received (or the peer stopped sending),
+ * stores the buffered packets and prepares the connection for streaming the reply.
+ */
+static void reactor_conn_process(struct reactor* reactor, struct reactor_conn* conn){
+	if (conn->reply.filefd < 0){
+		conn->mutex = reactor->mutex;
+		conn->reply.filefd = open_conn_file(&conn->mutex);
+		if (conn->reply.filefd < 0){
+			syslog(LOG_ERR, "Error opening file for read/write: %s\n", strerror(errno));
+			conn->state = CONN_DONE;
+			return;
+		}
+	}
+
+	int npackets = process_packets(conn->reply.filefd, &conn->rb, conn->eof, packets_per_reply(),
+		&conn->session, conn->mutex, &conn->ticket);
+	if (npackets < 0 || (npackets == 0 && config.keepalive)){
+		conn->state = CONN_DONE;
+		return;
+	}
+
+	atomic_fetch_add_explicit(&reactor->requests, npackets, memory_order_relaxed);
+	int result = (conn->ticket != 0) ? committer_result(conn->ticket) : 0;
+	if (result > 0){
+		conn->state = CONN_COMMIT;
+		LIST_INSERT_HEAD(&reactor->commits, conn, commit_entries);
+		return;
+	}
+	conn->state = (result == 0) ? CONN_SEND : CONN_DONE;
+}
+
+static void reactor_conn_recv(struct reactor* reactor, struct reactor_conn* conn){
+	while (conn->state == CONN_RECV){
+		if (conn->eof || recv_buffer_has_packet(&conn->rb)){
+			reactor_conn_process(reactor, conn);
+			return;
+		}
+
+		size_t free_bytes;
+		char* tail = recv_buffer_tail(&conn->rb, &free_bytes);
+		if (tail == NULL){
+			conn->state = CONN_DONE;
+			return;
+		}
+
+		ssize_t bytes_received = recv(conn->sockfd_in, tail, free_bytes, 0);
+		if (bytes_received < 0){
+			if (errno == EAGAIN || errno == EWOULDBLOCK){
+				return;
+			}
+			if (errno == EINTR){
+				continue;
+			}
+			syslog(LOG_ERR, "Error receiving data: %s\n", strerror(errno));
+			conn->state = CONN_DONE;
+			return;
+		}
+		if (bytes_received == 0){
+			conn->eof = true;
+			continue;
+		}
+		recv_buffer_commit(&conn->rb, bytes_received);
+
+		if (recv_buffer_has_packet(&conn->rb)){
+			syslog(LOG_DEBUG, "Newline found after %zu bytes", conn->rb.len);
+		}
+	}
+}
+
+/*
+ * Makes appends reach a connection entering CONN_TAIL. The reactor waits on
+ * the aesdchar device itself, which is readable whenever anyone wrote past the
+ * reply; appends to the data file are only known from appends. Either way it
+ * is a wakeup pushing to every tail, so an event of a connection closed
+ * earlier in the same batch is never followed.
+ */
+static void reactor_tail_start(struct reactor* reactor, struct reactor_conn* conn){
+	conn->tailing = true;
+	LIST_INSERT_HEAD(&reactor->tails, conn, tail_entries);
+#if (USE_AESD_CHAR_DEVICE == 1)
+	struct epoll_event event = {
+		.events = EPOLLIN | EPOLLET,
+		.data.ptr = reactor
+	};
+	if (epoll_ctl(reactor->epfd, EPOLL_CTL_ADD, conn->reply.filefd, &event) != 0){
+		syslog(LOG_ERR, "Error polling %s: %s\n", FILENAME, strerror(errno));
+		conn->state = CONN_DONE;
+	}
+#else
+	appends_subscribe();
+#endif
+}
+
+/*
+ * A finished reply closes the connection, starts tailing, or with keep-alive
+ * goes back to receiving the next packet.
+ */
+static void reactor_conn_send(struct reactor* reactor, struct reactor_conn* conn){
+	int rc = reply_stream_send(&conn->reply, conn->sockfd_in);
+	if (rc < 0){
+		conn->state = CONN_DONE;
+	} else if (rc > 0 && conn->session.tail){
+		conn->state = CONN_TAIL;
+		reactor_tail_start(reactor, conn);
+	} else if (rc > 0){
+		conn->state = config.keepalive ? CONN_RECV : CONN_DONE;
+	}
+}
+
+/*
+ * Sends what was appended since the last push. Whatever a tailing client
+ * sends is ignored, its socket is only read to notice it closing.
+ */
+static void reactor_conn_tail(struct reactor_conn* conn){
+	if (conn_peer_closed(conn->sockfd_in) || reply_stream_send(&conn->reply, conn->sockfd_in) < 0){
+		conn->state = CONN_DONE;
+	}
+}
+
+/*
+ * Moves a connection forward until it has to wait for the socket or for a
+ * group commit. Socket readiness is edge triggered, so a keep-alive
+ * connection returning to CONN_RECV reads right away: data that arrived
+ * while the reply was sent does not raise another event.
+ */
+static void reactor_conn_run(struct reactor* reactor, struct reactor_conn* conn){
+	while (true){
+		if (conn->state == CONN_RECV){
+			reactor_conn_recv(reactor, conn);
+			if (conn->state == CONN_RECV){
+				return;
+			}
+		}
+		if (conn->state == CONN_SEND){
+			reactor_conn_send(reactor, conn);
+			if (conn->state == CONN_SEND){
+				return;
+			}
+		}
+		if (conn->state == CONN_TAIL){
+			reactor_conn_tail(conn);
+			if (conn->state == CONN_TAIL){
+				return;
+			}
+		}
+		if (conn->state == CONN_DONE){
+			reactor_conn_close(reactor, conn);
+			return;
+		}
+		if (conn->state == CONN_COMMIT){
+			return;
+		}
+	}
+}
+
+/*
+ * Called when the committer made a batch durable: replies of connections
+ * whose packets are now on disk can be sent, connections whose packets
+ * failed to write are closed.
+ */
+static void reactor_commits_complete(struct reactor* reactor){
+	struct reactor_conn* conn = LIST_FIRST(&reactor->commits);
+	while (conn != NULL){
+		struct reactor_conn* next = LIST_NEXT(conn, commit_entries);
+		int result = committer_result(conn->ticket);
+		if (result <= 0){
+			LIST_REMOVE(conn, commit_entries);
+			conn->state = (result == 0) ? CONN_SEND : CONN_DONE;
+			reactor_conn_run(reactor, conn);
+		}
+		conn = next;
+	}
+}
+
+/* Called when data was appended to the file while connections tail it */
+static void reactor_tails_push(struct reactor* reactor){
+	struct reactor_conn* conn = LIST_FIRST(&reactor->tails);
+	while (conn != NULL){
+		struct reactor_conn* next = LIST_NEXT(conn, tail_entries);
+		reactor_conn_run(reactor, conn);
+		conn = next;
+	}
+}
+
+static void reactor_accept(struct reactor* reactor){
+	while (true){
+		struct sockaddr_in addr_client;
+		socklen_t sockaddr_client_len = sizeof(addr_client);
+
+		int sockfd_in = accept4(reactor->sockfd, (struct sockaddr*) &addr_client,
+			&sockaddr_client_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (sockfd_in < 0){
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR){
+				syslog(LOG_ERR, "accept: %s\n", strerror(errno));
+			}
+			return;
+		}
+
+		syslog(LOG_INFO, "Accepted connection from %s\n", inet_ntoa(addr_client.sin_addr));
+		atomic_fetch_add_explicit(&reactor->accepts, 1, memory_order_relaxed);
+
+		struct reactor_conn* conn = calloc(1, sizeof(struct reactor_conn));
+		if (conn == NULL){
+			syslog(LOG_ERR, "Error allocating connection state\n");
+			close(sockfd_in);
+			continue;
+		}
+		conn->sockfd_in = sockfd_in;
+		conn->addr_client = addr_client;
+		conn->state = CONN_RECV;
+		reply_stream_init(&conn->reply, -1);
+		if (recv_buffer_acquire(&conn->rb) != 0){
+			syslog(LOG_ERR, "Error allocating receive buffer\n");
+			close(sockfd_in);
+			free(conn);
+			continue;
+		}
+		LIST_INSERT_HEAD(&reactor->conns, conn, entries);
+
+		struct epoll_event event = {
+			.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET,
+			.data.ptr = conn
+		};
+		if (epoll_ctl(reactor->epfd, EPOLL_CTL_ADD, sockfd_in, &event) != 0){
+			syslog(LOG_ERR, "epoll_ctl: %s\n", strerror(errno));
+			reactor_conn_close(reactor, conn);
+		}
+	}
+}
+
+static void uring_free(struct uring* ring){
+	if (ring->filefd >= 0){
+		close(ring->filefd);
+	}
+	free(ring->bufs);
+	if (ring->buf_ring != NULL){
+		munmap(ring->buf_ring, ring->buf_ring_size);
+	}
+	if (ring->sqes != NULL){
+		munmap(ring->sqes, ring->sqes_size);
+	}
+	if (ring->ring_ptr != NULL){
+		munmap(ring->ring_ptr, ring->ring_size);
+	}
+	if (ring->ringfd >= 0){
+		close(ring->ringfd);
+	}
+	free(ring);
+}
+
+static void uring_buf_recycle(struct uring* ring, unsigned short bid){
+	struct io_uring_buf* buf = &ring->buf_ring->bufs[ring->buf_tail & (URING_BUF_COUNT - 1)];
+
+	buf->addr = (uintptr_t)(ring->bufs + (size_t)bid * URING_BUF_SIZE);
+	buf->len = URING_BUF_SIZE;
+	buf->bid = bid;
+	ring->buf_tail++;
+	__atomic_store_n(&ring->buf_ring->tail, ring->buf_tail, __ATOMIC_RELEASE);
+}
+
+/*
+ * Sets up a ring without liburing: maps the submission and completion queues,
+ * opens the data file shared by every request of this reactor and registers a
+ * ring of receive buffers the kernel picks from as data arrives.
+ */
+static struct uring* uring_init(void){
+	struct uring* ring = calloc(1, sizeof(struct uring));
+	if (ring == NULL){
+		return NULL;
+	}
+	ring->filefd = -1;
+
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	ring->ringfd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+	if (ring->ringfd < 0){
+		syslog(LOG_WARNING, "io_uring_setup: %s\n", strerror(errno));
+		uring_free(ring);
+		return NULL;
+	}
+	if (!(params.features & IORING_FEAT_SINGLE_MMAP)){
+		syslog(LOG_WARNING, "io_uring lacks IORING_FEAT_SINGLE_MMAP\n");
+		uring_free(ring);
+		return NULL;
+	}
+
+	size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	ring->ring_size = (sq_size > cq_size) ? sq_size : cq_size;
+	ring->ring_ptr = mmap(NULL, ring->ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		ring->ringfd, IORING_OFF_SQ_RING);
+	if (ring->ring_ptr == MAP_FAILED){
+		ring->ring_ptr = NULL;
+		syslog(LOG_WARNING, "mmap io_uring rings: %s\n", strerror(errno));
+		uring_free(ring);
+		return NULL;
+	}
+	ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		ring->ringfd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED){
+		ring->sqes = NULL;
+		syslog(LOG_WARNING, "mmap io_uring sqes: %s\n", strerror(errno));
+		uring_free(ring);
+		return NULL;
+	}
+
+	char* ptr = ring->ring_ptr;
+	ring->sq_entries = params.sq_entries;
+	ring->sq_head = (unsigned*)(ptr + params.sq_off.head);
+	ring->sq_tail = (unsigned*)(ptr + params.sq_off.tail);
+	ring->sq_mask = (unsigned*)(ptr + params.sq_off.ring_mask);
+	ring->sq_array = (unsigned*)(ptr + params.sq_off.array);
+	ring->cq_head = (unsigned*)(ptr + params.cq_off.head);
+	ring->cq_tail = (unsigned*)(ptr + params.cq_off.tail);
+	ring->cq_mask = (unsigned*)(ptr + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe*)(ptr + params.cq_off.cqes);
+	ring->sq_local_tail = *ring->sq_tail;
+
+	ring->buf_ring_size = URING_BUF_COUNT * sizeof(struct io_uring_buf);
+	ring->buf_ring = mmap(NULL, ring->buf_ring_size, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (ring->buf_ring == MAP_FAILED){
+		ring->buf_ring = NULL;
+		syslog(LOG_WARNING, "mmap io_uring buffer ring: %s\n", strerror(errno));
+		uring_free(ring);
+		return NULL;
+	}
+	struct io_uring_buf_reg reg = {
+		.ring_addr = (uintptr_t)ring->buf_ring,
+		.ring_entries = URING_BUF_COUNT,
+		.bgid = URING_BUF_GROUP
+	};
+	if (syscall(__NR_io_uring_register, ring->ringfd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0){
+		syslog(LOG_WARNING, "io_uring provided buffer ring: %s\n", strerror(errno));
+		uring_free(ring);
+		return NULL;
+	}
+	ring->bufs = malloc((size_t)URING_BUF_COUNT * URING_BUF_SIZE);
+	if (ring->bufs == NULL){
+		uring_free(ring);
+		return NULL;
+	}
+	for (unsigned short bid = 0; bid < URING_BUF_COUNT; bid++){
+		uring_buf_recycle(ring, bid);
+	}
+
+	ring->filefd = open(FILENAME, FILE_OPEN_FLAGS | O_CLOEXEC, 0644);
+	if (ring->filefd < 0){
+		syslog(LOG_ERR, "Error opening file for read/write: %s\n", strerror(errno));
+		uring_free(ring);
+		return NULL;
+	}
+
+	return ring;
+}
+
+static int uring_submit(struct uring* ring, unsigned wait_nr){
+	__atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+
+	while (true){
+		int rc = syscall(__NR_io_uring_enter, ring->ringfd, ring->to_submit, wait_nr,
+			wait_nr ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+		if (rc >= 0){
+			ring->to_submit -= ((unsigned)rc < ring->to_submit) ? (unsigned)rc : ring->to_submit;
+			return 0;
+		}
+		if (errno != EINTR){
+			return -1;
+		}
+		if (wait_nr){
+			return 0;
+		}
+	}
+}
+
+static struct io_uring_sqe* uring_get_sqe(struct uring* ring, enum uring_op op, void* owner){
+	unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	if (ring->sq_local_tail - head >= ring->sq_entries){
+		if (uring_submit(ring, 0) != 0){
+			syslog(LOG_ERR, "io_uring_enter: %s\n", strerror(errno));
+		}
+		head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+		if (ring->sq_local_tail - head >= ring->sq_entries){
+			return NULL;
+		}
+	}
+
+	unsigned index = ring->sq_local_tail & *ring->sq_mask;
+	struct io_uring_sqe* sqe = &ring->sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->user_data = (uintptr_t)owner | op;
+	ring->sq_array[index] = index;
+	ring->sq_local_tail++;
+	ring->to_submit++;
+	ring->inflight++;
+
+	return sqe;
+}
+
+static void uring_prep_rw(struct io_uring_sqe* sqe, int opcode, int fd, void* addr, size_t len, off_t offset){
+	sqe->opcode = opcode;
+	sqe->fd = fd;
+	sqe->addr = (uintptr_t)addr;
+	sqe->len = len;
+	sqe->off = (offset < 0) ? (__u64)-1 : (__u64)offset;
+}
+
+static int uring_queue_accept(struct reactor* reactor){
+	struct io_uring_sqe* sqe = uring_get_sqe(reactor->uring, URING_OP_ACCEPT, reactor);
+	if (sqe == NULL){
+		return -1;
+	}
+	uring_prep_rw(sqe, IORING_OP_ACCEPT, reactor->sockfd, NULL, 0, 0);
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->accept_flags = SOCK_CLOEXEC;
+	return 0;
+}
+
+static int uring_queue_wake(struct reactor* reactor){
+	struct io_uring_sqe* sqe = uring_get_sqe(reactor->uring, URING_OP_WAKE, reactor);
+	if (sqe == NULL){
+		return -1;
+	}
+	uring_prep_rw(sqe, IORING_OP_READ, reactor->wakefd, &reactor->uring->wake_value,
+		sizeof(reactor->uring->wake_value), -1);
+	return 0;
+}
+
+static int uring_queue_conn(struct reactor* reactor, struct reactor_conn* conn, enum uring_op op){
+	struct uring* ring = reactor->uring;
+	struct io_uring_sqe* sqe = uring_get_sqe(ring, op, conn);
+	if (sqe == NULL){
+		return -1;
+	}
+
+	switch (op){
+		case URING_OP_RECV:
+			uring_prep_rw(sqe, IORING_OP_RECV, conn->sockfd_in, NULL, URING_BUF_SIZE, 0);
+			sqe->flags = IOSQE_BUFFER_SELECT;
+			sqe->buf_group = URING_BUF_GROUP;
+			break;
+		case URING_OP_WRITE:
+			uring_prep_rw(sqe, IORING_OP_WRITE, ring->filefd, (void*)(conn->packet + conn->write_offs),
+				conn->packet_len - conn->write_offs, -1);
+			break;
+		case URING_OP_FSYNC:
+			uring_prep_rw(sqe, IORING_OP_FSYNC, ring->filefd, NULL, 0, 0);
+			break;
+		case URING_OP_READ: {
+			/* At the published length this becomes an empty read, which completes like end of file */
+			size_t len = conn->reply.copy ? sizeof(conn->reply.buff) : REPLY_CHUNK_SIZE;
+			off_t published = committer_published_len();
+			if (published >= 0 && published - conn->read_offs < (off_t)len){
+				len = (published > conn->read_offs) ? (size_t)(published - conn->read_offs) : 0;
+			}
+			/* a delta session on the device reads a file of its own at its file position */
+			int filefd = (conn->reply.filefd >= 0) ? conn->reply.filefd : ring->filefd;
+			off_t read_offs = (conn->reply.filefd >= 0) ? -1 : conn->read_offs;
+			if (conn->reply.copy){
+				uring_prep_rw(sqe, IORING_OP_READ, filefd, conn->reply.buff, len, read_offs);
+			} else {
+				uring_prep_rw(sqe, IORING_OP_SPLICE, conn->reply.pipefd[1], NULL, len, -1);
+				sqe->splice_fd_in = filefd;
+				sqe->splice_off_in = read_offs;
+				sqe->splice_flags = SPLICE_F_MOVE;
+			}
+			break;
+		}
+		case URING_OP_SEND:
+			if (conn->reply.copy){
+				uring_prep_rw(sqe, IORING_OP_SEND, conn->sockfd_in, conn->reply.buff + conn->reply.offs,
+					conn->reply.len - conn->reply.offs, 0);
+				sqe->msg_flags = MSG_NOSIGNAL;
+			} else {
+				uring_prep_rw(sqe, IORING_OP_SPLICE, conn->sockfd_in, NULL, conn->reply.pipe_pending, -1);
+				sqe->splice_fd_in = conn->reply.pipefd[0];
+				sqe->splice_off_in = (__u64)-1;
+				sqe->splice_flags = SPLICE_F_MOVE;
+			}
+			break;
+		case URING_OP_CLOSE:
+			uring_prep_rw(sqe, IORING_OP_CLOSE, conn->sockfd_in, NULL, 0, 0);
+			break;
+		case URING_OP_POLL:
+			uring_prep_rw(sqe, IORING_OP_POLL_ADD, conn->reply.filefd, NULL, 0, 0);
+			sqe->poll32_events = POLLIN;
+			break;
+		default:
+			break;
+	}
+
+	return 0;
+}
+
+/*
+ * Works through the buffered packets. File writes are submitted one at a time
+ * and this is called again once a write completed. Seek commands need an ioctl
+ * on a file of their own, which has no io_uring equivalent, so they and the
+ * other control commands go through process_packet() and the reply starts at
+ * the resulting file position. A delta session on the device keeps that file
+ * and reads through it, as its position only names the stream offset asked
+ * for there. When every packet is stored (with keep-alive: one packet) the reply is started.
+ */
+static int uring_conn_process(struct reactor* reactor, struct reactor_conn* conn){
+	const char* packet;
+	size_t packet_len;
+
+	if (conn->reply.pipefd[0] < 0 && !conn->reply.copy && pipe2(conn->reply.pipefd, O_CLOEXEC) != 0){
+		conn->reply.copy = true;
+	}
+
+	while (!(config.keepalive && conn->stored) &&
+		(recv_buffer_next_packet(&conn->rb, &packet, &packet_len) ||
+		(conn->eof && recv_buffer_take_rest(&conn->rb, &packet, &packet_len)))){
+		atomic_fetch_add_explicit(&reactor->requests, 1, memory_order_relaxed);
+		conn->stored = true;
+
+		if (is_control_packet(packet, packet_len)){
+			int filefd = open(FILENAME, FILE_OPEN_FLAGS, 0644);
+			if (filefd < 0){
+				syslog(LOG_ERR, "Error opening file for read/write: %s\n", strerror(errno));
+				return -1;
+			}
+			uint64_t ticket;
+			if (process_packet(filefd, packet, packet_len, &conn->session, reactor->mutex, &ticket) != 0){
+				close(filefd);
+				return -1;
+			}
+#if (USE_AESD_CHAR_DEVICE == 1)
+			/* the file position stands for a stream offset only in the file it was set in */
+			if (conn->session.delta){
+				if (conn->reply.filefd >= 0){
+					close(conn->reply.filefd);
+				}
+				conn->reply.filefd = filefd;
+				continue;
+			}
+#endif
+			conn->read_offs = lseek(filefd, 0, SEEK_CUR);
+			close(filefd);
+			if (conn->read_offs < 0){
+				return -1;
+			}
+			continue;
+		}
+
+		if (!conn->session.delta){
+			conn->read_offs = 0;
+		}
+		if (committer_queues_packets()){
+			conn->ticket = committer_append(packet, packet_len);
+			if (conn->ticket == 0){
+				syslog(LOG_ERR, "Error queueing packet of %zu bytes for group commit\n", packet_len);
+				return -1;
+			}
+			continue;
+		}
+
+		syslog(LOG_DEBUG, "Writing %zu bytes to file", packet_len);
+		conn->packet = packet;
+		conn->packet_len = packet_len;
+		conn->write_offs = 0;
+		conn->state = CONN_WRITE;
+		return uring_queue_conn(reactor, conn, URING_OP_WRITE);
+	}
+
+	if (config.keepalive && !conn->stored){
+		conn->state = CONN_DONE;
+		return uring_queue_conn(reactor, conn, URING_OP_CLOSE);
+	}
+	if (conn->written && config.durability == DURABILITY_PER_REQUEST){
+		conn->written = false;
+		conn->state = CONN_WRITE;
+		return uring_queue_conn(reactor, conn, URING_OP_FSYNC);
+	}
+	int result = (conn->ticket != 0) ? committer_result(conn->ticket) : 0;
+	if (result > 0){
+		conn->state = CONN_COMMIT;
+		LIST_INSERT_HEAD(&reactor->commits, conn, commit_entries);
+		return 0;
+	}
+	if (result < 0){
+		return -1;
+	}
+	conn->state = CONN_SEND;
+	return uring_queue_conn(reactor, conn, URING_OP_READ);
+}
+
+static void uring_conn_free(struct reactor_conn* conn){
+	if (conn->state == CONN_COMMIT){
+		LIST_REMOVE(conn, commit_entries);
+	}
+	if (conn->tailing){
+		LIST_REMOVE(conn, tail_entries);
+#if (USE_AESD_CHAR_DEVICE == 0)
+		appends_unsubscribe();
+#endif
+	}
+	reply_stream_close(&conn->reply);
+	syslog(LOG_INFO, "Closed connection from %s\n", inet_ntoa(conn->addr_client.sin_addr));
+	LIST_REMOVE(conn, entries);
+	recv_buffer_release(&conn->rb);
+	free(conn);
+}
+
+/*
+ * Called once the socket is closed. The recv or device poll of a tailing
+ * connection may still be in flight, and the last completion frees the
+ * connection then.
+ */
+static void uring_conn_release(struct reactor_conn* conn){
+	conn->state = CONN_DONE;
+	conn->closed = true;
+	if (!conn->watching && conn->polls == 0){
+		uring_conn_free(conn);
+	}
+}
+
+/* Removes the poll of the device a tailing connection waits in, which completes both */
+static void uring_conn_unpoll(struct reactor* reactor, struct reactor_conn* conn){
+	struct io_uring_sqe* sqe = uring_get_sqe(reactor->uring, URING_OP_POLL, conn);
+	if (sqe != NULL){
+		uring_prep_rw(sqe, IORING_OP_POLL_REMOVE, -1, NULL, 0, 0);
+		sqe->addr = (uintptr_t)conn | URING_OP_POLL;
+		conn->polls++;
+	}
+}
+
+/*
+ * Closes a connection that has no read, write or send in flight. Shutting
+ * the socket down first completes the recv a tailing connection keeps, as
+ * closing it would not, and its poll of the device is removed.
+ */
+static void uring_conn_teardown(struct reactor* reactor, struct reactor_conn* conn){
+	conn->state = CONN_DONE;
+	if (conn->watching){
+		shutdown(conn->sockfd_in, SHUT_RDWR);
+	}
+	if (conn->polls > 0){
+		uring_conn_unpoll(reactor, conn);
+	}
+	if (uring_queue_conn(reactor, conn, URING_OP_CLOSE) != 0){
+		close(conn->sockfd_in);
+		uring_conn_release(conn);
+	}
+}
+
+static int uring_conn_recv(struct reactor* reactor, struct reactor_conn* conn, struct io_uring_cqe* cqe){
+	struct uring* ring = reactor->uring;
+
+	if (cqe->res == -ENOBUFS){
+		return uring_queue_conn(reactor, conn, URING_OP_RECV);
+	}
+	if (cqe->res < 0){
+		syslog(LOG_ERR, "Error receiving data: %s\n", strerror(-cqe->res));
+		return -1;
+	}
+	if (cqe->res == 0){
+		conn->eof = true;
+		return uring_conn_process(reactor, conn);
+	}
+
+	unsigned short bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+	size_t bytes_received = cqe->res;
+	if (recv_buffer_reserve(&conn->rb, bytes_received) != 0){
+		uring_buf_recycle(ring, bid);
+		return -1;
+	}
+	memcpy(conn->rb.data + conn->rb.len, ring->bufs + (size_t)bid * URING_BUF_SIZE, bytes_received);
+	uring_buf_recycle(ring, bid);
+	recv_buffer_commit(&conn->rb, bytes_received);
+
+	if (recv_buffer_has_packet(&conn->rb)){
+		syslog(LOG_DEBUG, "Newline found after %zu bytes", conn->rb.len);
+		return uring_conn_process(reactor, conn);
+	}
+	return uring_queue_conn(reactor, conn, URING_OP_RECV);
+}
+
+/*
+ * A tailing connection keeps a recv in flight next to its reads and sends,
+ * only to notice the client closing: what it receives is dropped.
+ */
+static int uring_conn_watch(struct reactor* reactor, struct reactor_conn* conn, struct io_uring_cqe* cqe){
+	conn->watching = false;
+	if (conn->closed){
+		if (conn->polls == 0){
+			uring_conn_free(conn);
+		}
+		return 0;
+	}
+	if (conn->state == CONN_DONE){
+		return 0;
+	}
+
+	if (cqe->flags & IORING_CQE_F_BUFFER){
+		uring_buf_recycle(reactor->uring, cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+	}
+	if (cqe->res > 0 || cqe->res == -ENOBUFS){
+		if (uring_queue_conn(reactor, conn, URING_OP_RECV) != 0){
+			return (conn->state == CONN_TAIL) ? -1 : 0;
+		}
+		conn->watching = true;
+		return 0;
+	}
+
+	/* with a read or send in flight, uring_conn_tail sees eof once it completes */
+	conn->eof = true;
+	return (conn->state == CONN_TAIL) ? -1 : 0;
+}
+
+#if (USE_AESD_CHAR_DEVICE == 1)
+/*
+ * A tailing connection waits in CONN_TAIL for its file of the device to turn
+ * readable, which it is once anyone wrote past the reply, with its recv in
+ * flight next to the poll. Wakeups of the reactor leave it waiting there.
+ */
+static int uring_conn_tail(struct reactor* reactor, struct reactor_conn* conn){
+	if (conn->eof){
+		return -1;
+	}
+	if (conn->state == CONN_TAIL){
+		return 0;
+	}
+	if (!conn->tailing){
+		conn->tailing = true;
+		LIST_INSERT_HEAD(&reactor->tails, conn, tail_entries);
+		if (uring_queue_conn(reactor, conn, URING_OP_RECV) != 0){
+			return -1;
+		}
+		conn->watching = true;
+	}
+
+	conn->state = CONN_TAIL;
+	if (uring_queue_conn(reactor, conn, URING_OP_POLL) != 0){
+		return -1;
+	}
+	conn->polls++;
+	return 0;
+}
+
+/* A poll of the device completed: reread, or once the connection is going away, let it go */
+static int uring_conn_polled(struct reactor* reactor, struct reactor_conn* conn, struct io_uring_cqe* cqe){
+	conn->polls--;
+	if (conn->closed){
+		if (!conn->watching && conn->polls == 0){
+			uring_conn_free(conn);
+		}
+		return 0;
+	}
+	if (conn->state != CONN_TAIL){
+		return 0;
+	}
+	if (cqe->res < 0){
+		syslog(LOG_ERR, "Error polling %s: %s\n", FILENAME, strerror(-cqe->res));
+		return -1;
+	}
+
+	conn->state = CONN_SEND;
+	return uring_queue_conn(reactor, conn, URING_OP_READ);
+}
+#else
+/*
+ * A tailing connection rereads the file when something was appended since
+ * its last read was queued, and otherwise waits in CONN_TAIL with only its
+ * recv in flight. Comparing sequence numbers catches appends whose wakeup
+ * was handled while the read was still running. Subscribing happens before
+ * the first sequence number is taken, so the first pass always rereads once.
+ */
+static int uring_conn_tail(struct reactor* reactor, struct reactor_conn* conn){
+	if (conn->eof){
+		return -1;
+	}
+	if (!conn->tailing){
+		conn->tailing = true;
+		LIST_INSERT_HEAD(&reactor->tails, conn, tail_entries);
+		appends_subscribe();
+		if (uring_queue_conn(reactor, conn, URING_OP_RECV) != 0){
+			return -1;
+		}
+		conn->watching = true;
+	} else if (appends_seq() == conn->tail_seq){
+		conn->state = CONN_TAIL;
+		return 0;
+	}
+
+	conn->tail_seq = appends_seq();
+	conn->state = CONN_SEND;
+	return uring_queue_conn(reactor, conn, URING_OP_READ);
+}
+#endif
+
+/*
+ * A finished reply closes the connection, starts tailing, or with keep-alive
+ * moves on to the next buffered packet or receives more.
+ */
+static int uring_conn_replied(struct reactor* reactor, struct reactor_conn* conn){
+	if (conn->session.tail){
+		return uring_conn_tail(reactor, conn);
+	}
+	if (!config.keepalive){
+		conn->state = CONN_DONE;
+		return uring_queue_conn(reactor, conn, URING_OP_CLOSE);
+	}
+
+	conn->stored = false;
+	conn->ticket = 0;
+	if (conn->eof || recv_buffer_has_packet(&conn->rb)){
+		return uring_conn_process(reactor, conn);
+	}
+	conn->state = CONN_RECV;
+	return uring_queue_conn(reactor, conn, URING_OP_RECV);
+}
+
+static int uring_conn_complete(struct reactor* reactor, struct reactor_conn* conn,
+	enum uring_op op, struct io_uring_cqe* cqe){
+	switch (op){
+		case URING_OP_RECV:
+			if (conn->tailing){
+				return uring_conn_watch(reactor, conn, cqe);
+			}
+			return uring_conn_recv(reactor, conn, cqe);
+		case URING_OP_WRITE:
+			if (cqe->res < 0){
+				syslog(LOG_ERR, "Error writing to file: %s\n", strerror(-cqe->res));
+				return -1;
+			}
+			conn->write_offs += cqe->res;
+			if (conn->write_offs < conn->packet_len){
+				return uring_queue_conn(reactor, conn, URING_OP_WRITE);
+			}
+			conn->written = true;
+			if (config.durability == DURABILITY_INTERVAL){
+				committer_mark_dirty();
+			}
+			appends_notify();
+			return uring_conn_process(reactor, conn);
+		case URING_OP_FSYNC:
+			return uring_conn_process(reactor, conn);
+		case URING_OP_READ:
+			if (cqe->res == -EINVAL && !conn->reply.copy){
+				conn->reply.copy = true;
+				return uring_queue_conn(reactor, conn, URING_OP_READ);
+			}
+			if (cqe->res < 0){
+				syslog(LOG_ERR, "Error reading from file: %s\n", strerror(-cqe->res));
+				return -1;
+			}
+			if (cqe->res == 0){
+				return uring_conn_replied(reactor, conn);
+			}
+			conn->read_offs += cqe->res;
+			if (conn->reply.copy){
+				conn->reply.len = cqe->res;
+				conn->reply.offs = 0;
+			} else {
+				conn->reply.pipe_pending = cqe->res;
+			}
+			return uring_queue_conn(reactor, conn, URING_OP_SEND);
+		case URING_OP_SEND:
+			if (cqe->res < 0){
+				syslog(LOG_ERR, "Error sending data: %s\n", strerror(-cqe->res));
+				return -1;
+			}
+			if (conn->reply.copy){
+				conn->reply.offs += cqe->res;
+				if (conn->reply.offs < conn->reply.len){
+					return uring_queue_conn(reactor, conn, URING_OP_SEND);
+				}
+			} else {
+				conn->reply.pipe_pending -= cqe->res;
+				if (conn->reply.pipe_pending > 0){
+					return uring_queue_conn(reactor, conn, URING_OP_SEND);
+				}
+			}
+			return uring_queue_conn(reactor, conn, URING_OP_READ);
+#if (USE_AESD_CHAR_DEVICE == 1)
+		case URING_OP_POLL:
+			return uring_conn_polled(reactor, conn, cqe);
+#endif
+		default:
+			return 0;
+	}
+}
+
+static void uring_accept_complete(struct reactor* reactor, struct io_uring_cqe* cqe){
+	if (!(cqe->flags & IORING_CQE_F_MORE) && !signal_caught){
+		uring_queue_accept(reactor);
+	}
+	if (cqe->res < 0){
+		if (cqe->res != -EINTR && cqe->res != -ECANCELED){
+			syslog(LOG_ERR, "accept: %s\n", strerror(-cqe->res));
+		}
+		return;
+	}
+
+	int sockfd_in = cqe->res;
+	struct sockaddr_in addr_client;
+	socklen_t sockaddr_client_len = sizeof(addr_client);
+	memset(&addr_client, 0, sizeof(addr_client));
+	getpeername(sockfd_in, (struct sockaddr*) &addr_client, &sockaddr_client_len);
+
+	syslog(LOG_INFO, "Accepted connection from %s\n", inet_ntoa(addr_client.sin_addr));
+	atomic_fetch_add_explicit(&reactor->accepts, 1, memory_order_relaxed);
+
+	struct reactor_conn* conn = calloc(1, sizeof(struct reactor_conn));
+	if (conn == NULL || recv_buffer_acquire(&conn->rb) != 0){
+		syslog(LOG_ERR, "Error allocating connection state\n");
+		free(conn);
+		close(sockfd_in);
+		return;
+	}
+	conn->sockfd_in = sockfd_in;
+	conn->addr_client = addr_client;
+	conn->state = CONN_RECV;
+	reply_stream_init(&conn->reply, -1);
+	LIST_INSERT_HEAD(&reactor->conns, conn, entries);
+
+	if (uring_queue_conn(reactor, conn, URING_OP_RECV) != 0){
+		close(sockfd_in);
+		uring_conn_free(conn);
+	}
+}
+
+static void uring_commits_complete(struct reactor* reactor){
+	struct reactor_conn* conn = LIST_FIRST(&reactor->commits);
+	while (conn != NULL){
+		struct reactor_conn* next = LIST_NEXT(conn, commit_entries);
+		int result = committer_result(conn->ticket);
+		if (result <= 0){
+			LIST_REMOVE(conn, commit_entries);
+			conn->state = CONN_SEND;
+			if (result < 0 || uring_queue_conn(reactor, conn, URING_OP_READ) != 0){
+				uring_conn_teardown(reactor, conn);
+			}
+		}
+		conn = next;
+	}
+}
+
+/*
+ * Called when data was appended to the file. Tailing connections with a read
+ * in flight pick it up when that read completes.
+ */
+static void uring_tails_push(struct reactor* reactor){
+	struct reactor_conn* conn = LIST_FIRST(&reactor->tails);
+	while (conn != NULL){
+		struct reactor_conn* next = LIST_NEXT(conn, tail_entries);
+		if (conn->state == CONN_TAIL && uring_conn_tail(reactor, conn) != 0){
+			uring_conn_teardown(reactor, conn);
+		}
+		conn = next;
+	}
+}
+
+static void uring_handle_cqe(struct reactor* reactor, struct io_uring_cqe* cqe){
+	enum uring_op op = cqe->user_data & URING_OP_MASK;
+	void* owner = (void*)(uintptr_t)(cqe->user_data & ~URING_OP_MASK);
+
+	if (!(cqe->flags & IORING_CQE_F_MORE)){
+		reactor->uring->inflight--;
+	}
+
+	switch (op){
+		case URING_OP_ACCEPT:
+			uring_accept_complete(reactor, cqe);
+			break;
+		case URING_OP_WAKE:
+			if (!signal_caught){
+				uring_queue_wake(reactor);
+			}
+			uring_commits_complete(reactor);
+			uring_tails_push(reactor);
+			break;
+		default: {
+			struct reactor_conn* conn = owner;
+			if (op == URING_OP_CLOSE){
+				uring_conn_release(conn);
+				break;
+			}
+			if (uring_conn_complete(reactor, conn, op, cqe) != 0){
+				uring_conn_teardown(reactor, conn);
+			}
+			break;
+		}
+	}
+}
+
+/*
+ * io_uring event loop: every iteration submits all queued requests and waits
+ * for completions with a single io_uring_enter call, so the accept, receive,
+ * file write, fsync, read and send of many connections share one syscall.
+ */
+static void* uring_reactor_loop(struct reactor* reactor){
+	struct uring* ring = reactor->uring;
+
+	if (uring_queue_accept(reactor) != 0 || uring_queue_wake(reactor) != 0){
+		reactor->failed = true;
+		return reactor;
+	}
+
+	while (ring->inflight > 0){
+		if (uring_submit(ring, 1) != 0){
+			syslog(LOG_ERR, "io_uring_enter: %s\n", strerror(errno));
+			reactor->failed = true;
+			break;
+		}
+
+		unsigned head = *ring->cq_head;
+		unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+		while (head != tail){
+			uring_handle_cqe(reactor, &ring->cqes[head & *ring->cq_mask]);
+			head++;
+		}
+		__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+		if (signal_caught && !reactor->stopping){
+			/*
+			 * Cancel the multishot accept and fail pending socket I/O so every
+			 * request drains. The cancel completion is tagged as a wakeup,
+			 * which is not rearmed once signal_caught is set.
+			 */
+			struct io_uring_sqe* sqe = uring_get_sqe(ring, URING_OP_WAKE, reactor);
+			if (sqe != NULL){
+				uring_prep_rw(sqe, IORING_OP_ASYNC_CANCEL, -1, NULL, 0, 0);
+				sqe->cancel_flags = IORING_ASYNC_CANCEL_ANY;
+			}
+			struct reactor_conn* conn;
+			LIST_FOREACH(conn, &reactor->conns, entries){
+				shutdown(conn->sockfd_in, SHUT_RDWR);
+			}
+			reactor->stopping = true;
+		}
+	}
+
+	return reactor;
+}
+
+static int reactor_init(struct reactor* reactor){
+	LIST_INIT(&reactor->conns);
+	LIST_INIT(&reactor->commits);
+	LIST_INIT(&reactor->tails);
+	atomic_init(&reactor->accepts, 0);
+	atomic_init(&reactor->requests, 0);
+	reactor->epfd = -1;
+
+	if (set_nonblocking(reactor->sockfd) != 0){
+		syslog(LOG_ERR, "Error making listener non-blocking: %s\n", strerror(errno));
+		return -1;
+	}
+
+	reactor->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (reactor->wakefd < 0){
+		syslog(LOG_ERR, "eventfd: %s\n", strerror(errno));
+		return -1;
+	}
+
+	if (committer_queues_packets()){
+		committer_notify_register(reactor->wakefd);
+	}
+	appends_register(reactor->wakefd);
+
+	if (config.mode == SERVER_MODE_URING){
+		reactor->uring = uring_init();
+		if (reactor->uring != NULL){
+			return 0;
+		}
+		syslog(LOG_WARNING, "io_uring not available, reactor %d falls back to epoll\n", reactor->id);
+	}
 
-	bool thread_complete;
-    bool thread_complete_success;
-};
+	reactor->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (reactor->epfd < 0){
+		syslog(LOG_ERR, "epoll_create1: %s\n", strerror(errno));
+		committer_notify_unregister(reactor->wakefd);
+		appends_unregister(reactor->wakefd);
+		close(reactor->wakefd);
+		return -1;
+	}
 
-struct conn_thread{
-	pthread_t thread;
-	struct conn_thread_data thread_data;
+	struct epoll_event listen_event = {
+		.events = EPOLLIN | EPOLLET,
+		.data.ptr = NULL
+	};
+	struct epoll_event wake_event = {
+		.events = EPOLLIN | EPOLLET,
+		.data.ptr = reactor
+	};
+	if (epoll_ctl(reactor->epfd, EPOLL_CTL_ADD, reactor->sockfd, &listen_event) != 0 ||
+		epoll_ctl(reactor->epfd, EPOLL_CTL_ADD, reactor->wakefd, &wake_event) != 0){
+		syslog(LOG_ERR, "epoll_ctl: %s\n", strerror(errno));
+		committer_notify_unregister(reactor->wakefd);
+		appends_unregister(reactor->wakefd);
+		close(reactor->wakefd);
+		close(reactor->epfd);
+		return -1;
+	}
 
-	SLIST_ENTRY(conn_thread) entries;
-};
+	return 0;
+}
 
-static void signal_handler (int signal_number){
-    if (signal_number == SIGINT || signal_number == SIGTERM){
-        syslog(LOG_INFO, "Caught signal, exiting");
-		signal_caught = true;
-    }
+static void reactor_destroy(struct reactor* reactor){
+	if (reactor->uring != NULL){
+		while (!LIST_EMPTY(&reactor->conns)){
+			struct reactor_conn* conn = LIST_FIRST(&reactor->conns);
+			if (!conn->closed){
+				close(conn->sockfd_in);
+			}
+			uring_conn_free(conn);
+		}
+		uring_free(reactor->uring);
+		reactor->uring = NULL;
+	} else {
+		while (!LIST_EMPTY(&reactor->conns)){
+			reactor_conn_close(reactor, LIST_FIRST(&reactor->conns));
+		}
+		close(reactor->epfd);
+	}
+	committer_notify_unregister(reactor->wakefd);
+	appends_unregister(reactor->wakefd);
+	close(reactor->wakefd);
 }
 
-#if (USE_AESD_CHAR_DEVICE == 0)
-struct timer_thread_data{
-    pthread_mutex_t* mutex;
+/*
+ * Serves every connection of one listener from a single thread using an edge
+ * triggered epoll loop. Sockets are non-blocking, so each connection keeps its
+ * own progress through the receive and send phases in struct reactor_conn.
+ */
+static void* reactor_thread(void* reactor_data){
+	struct reactor* reactor = reactor_data;
 
-	bool thread_complete;
-    bool thread_complete_success;
-};
+	if (reactor->cpu >= 0){
+		cpu_set_t cpuset;
+		CPU_ZERO(&cpuset);
+		CPU_SET(reactor->cpu, &cpuset);
+		int rc = pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset);
+		if (rc != 0){
+			syslog(LOG_ERR, "Failed to pin reactor %d to cpu %d: %s\n", reactor->id, reactor->cpu, strerror(rc));
+		}
+	}
 
-void timer_thread(union sigval timer_data){
-    struct timer_thread_data* thread_args = timer_data.sival_ptr;
+	if (reactor->uring != NULL){
+		return uring_reactor_loop(reactor);
+	}
 
-	time_t rawtime;
-	struct tm *info;
-	char buffer[80];
+	struct epoll_event events[REACTOR_MAX_EVENTS];
+	while (!signal_caught){
+		int nevents = epoll_wait(reactor->epfd, events, REACTOR_MAX_EVENTS, -1);
+		if (nevents < 0){
+			if (errno == EINTR){
+				continue;
+			}
+			syslog(LOG_ERR, "epoll_wait: %s\n", strerror(errno));
+			reactor->failed = true;
+			break;
+		}
 
-	time( &rawtime );
-	info = localtime( &rawtime );
-	strftime(buffer, sizeof(buffer),"%F %T", info);
+		/*
+		 * Wakeups are handled after the socket events: they may close any
+		 * connection, which must not happen to one with an event still
+		 * pending in this batch.
+		 */
+		bool woken = false;
+		for (int i = 0; i < nevents; i++){
+			if (events[i].data.ptr == NULL){
+				reactor_accept(reactor);
+				continue;
+			}
+			if (events[i].data.ptr == reactor){
+				woken = true;
+				continue;
+			}
 
-	FILE* file = fopen(FILENAME, "a");
-	if (file == NULL){
-		syslog(LOG_ERR, "Error opening file for append: %s\n", strerror(errno));
-		thread_args->thread_complete = true;
-		thread_args->thread_complete_success = false;
-		return;
+			struct reactor_conn* conn = events[i].data.ptr;
+			if (events[i].events & EPOLLERR){
+				reactor_conn_close(reactor, conn);
+				continue;
+			}
+			reactor_conn_run(reactor, conn);
+		}
+		if (woken){
+			eventfd_t value;
+			eventfd_read(reactor->wakefd, &value);
+			reactor_commits_complete(reactor);
+			reactor_tails_push(reactor);
+		}
 	}
 
-	int rc;
-	rc = pthread_mutex_lock(thread_args->mutex);
-	if (rc != 0){
-		syslog(LOG_ERR, "Mutex lock failed to lock with %d\n", rc);
-		thread_args->thread_complete = true;
-		thread_args->thread_complete_success = false;
-		return;
+	return reactor;
+}
+
+static void log_reactor_stats(struct reactor* reactors, int nreactors){
+	for (int i = 0; i < nreactors; i++){
+		syslog(LOG_INFO, "Reactor %d (cpu %d): %lu accepts, %lu requests\n",
+			reactors[i].id, reactors[i].cpu,
+			atomic_load_explicit(&reactors[i].accepts, memory_order_relaxed),
+			atomic_load_explicit(&reactors[i].requests, memory_order_relaxed));
 	}
-	if (fprintf(file, "timestamp:%s\n", buffer) < 0){
-		syslog(LOG_ERR, "Error writing to file: %s\n", strerror(errno));
-		thread_args->thread_complete = true;
-		thread_args->thread_complete_success = false;
-		return;
+}
+
+/*
+ * Starts one reactor thread per listener. The main thread only waits for
+ * signals: SIGUSR1 logs the per reactor counters, SIGINT/SIGTERM wake every
+ * reactor through its eventfd and wait for them to finish.
+ */
+static int run_reactors(int* listeners, int nreactors, bool pin_cpus){
+	int retval = 0;
+	int started = 0;
+	long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+	struct reactor* reactors = calloc(nreactors, sizeof(struct reactor));
+	if (reactors == NULL){
+		syslog(LOG_ERR, "Error allocating %d reactors\n", nreactors);
+		return -1;
 	}
-	if (fclose(file) == EOF){
-		syslog(LOG_ERR, "Error closing the file: %s\n", strerror(errno));
-		thread_args->thread_complete = true;
-		thread_args->thread_complete_success = false;
-		return;
+
+	sigset_t block_mask, orig_mask;
+	sigemptyset(&block_mask);
+	sigaddset(&block_mask, SIGINT);
+	sigaddset(&block_mask, SIGTERM);
+	sigaddset(&block_mask, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &block_mask, &orig_mask);
+
+	for (int i = 0; i < nreactors; i++){
+		reactors[i].id = i;
+		reactors[i].sockfd = listeners[i];
+		reactors[i].mutex = &lock;
+		reactors[i].cpu = (pin_cpus && ncpus > 0) ? (int)(i % ncpus) : -1;
+
+		if (reactor_init(&reactors[i]) != 0){
+			retval = -1;
+			break;
+		}
+		int rc = pthread_create(&reactors[i].thread, NULL, reactor_thread, &reactors[i]);
+		if (rc != 0){
+			syslog(LOG_ERR, "Failed to create reactor thread %d", rc);
+			reactor_destroy(&reactors[i]);
+			retval = -1;
+			break;
+		}
+		started++;
 	}
-	rc = pthread_mutex_unlock(thread_args->mutex);
-	if (rc != 0){
-		syslog(LOG_ERR, "Mutex unlock failed to lock with %d\n", rc);
-		thread_args->thread_complete = true;
-		thread_args->thread_complete_success = false;
-		return;
+
+	while (retval == 0 && !signal_caught){
+		sigsuspend(&orig_mask);
+		if (stats_requested){
+			stats_requested = false;
+			log_reactor_stats(reactors, started);
+		}
 	}
 
-	thread_args->thread_complete = true;
-	thread_args->thread_complete_success = true;
+	signal_caught = true;
+	for (int i = 0; i < started; i++){
+		eventfd_write(reactors[i].wakefd, 1);
+	}
+	for (int i = 0; i < started; i++){
+		pthread_join(reactors[i].thread, NULL);
+		if (reactors[i].failed){
+			retval = -1;
+		}
+		reactor_destroy(&reactors[i]);
+	}
+	log_reactor_stats(reactors, started);
+
+	pthread_sigmask(SIG_SETMASK, &orig_mask, NULL);
+	free(reactors);
+
+	return retval;
 }
-#endif
 
-void* handle_conn(void* conn_data){
-	int rc;
+static void* pool_worker_thread(void* worker_data){
+	struct pool_worker* worker = worker_data;
+	struct worker_pool* pool = worker->pool;
 
-    struct conn_thread_data* thread_args = (struct conn_thread_data *) conn_data;
+	pthread_mutex_lock(&pool->mutex);
+	while (true){
+		while (pool->queue_len == 0 && !pool->stopping){
+			pthread_cond_wait(&pool->work, &pool->mutex);
+		}
+		if (pool->stopping){
+			break;
+		}
+
+		struct conn_work work = pool->queue[pool->queue_head];
+		pool->queue_head = (pool->queue_head + 1) % pool->limit;
+		pool->queue_len--;
+		pool->busy++;
+		worker->sockfd_in = work.sockfd_in;
 
-    int total_bytes = 0;
-	int buffer_size = 1024;
-	char *buffer = (char*)malloc(buffer_size);
-	int bytes_received;
+		long long wait_ms = committer_now_ms() - work.queued_ms;
+		pool->dequeued++;
+		pool->wait_total_ms += wait_ms;
+		if (wait_ms > pool->wait_max_ms){
+			pool->wait_max_ms = wait_ms;
+		}
+		pthread_mutex_unlock(&pool->mutex);
 
-	while ((bytes_received = recv(thread_args->sockfd_in, buffer + total_bytes, buffer_size - total_bytes - 1, 0)) > 0){
-		total_bytes += bytes_received;
-		buffer[total_bytes] = '\0';
-		syslog(LOG_DEBUG, "Received bytes: %s of size %d\n", buffer, total_bytes);
+		bool success = serve_conn(work.sockfd_in, pool->file_mutex);
 
-		if (signal_caught){
-			thread_args->thread_complete = true;
-			return conn_data;
+		pthread_mutex_lock(&pool->mutex);
+		/* cleared before closing, so pool_stop never shuts down a reused fd */
+		worker->sockfd_in = -1;
+		close(work.sockfd_in);
+		pool->busy--;
+		pool->inflight--;
+		if (pool->paused){
+			pool->paused = false;
+			eventfd_write(pool->slotfd, 1);
 		}
-		if (bytes_received < 0){
-			syslog(LOG_ERR, "Error receiving data: %s\n", strerror(errno));
-			thread_args->thread_complete = true;
-			thread_args->thread_complete_success = false;
-			return conn_data;
+		pthread_mutex_unlock(&pool->mutex);
+
+		if (success){
+			syslog(LOG_INFO, "Closed connection from %s\n", inet_ntoa(work.addr_client.sin_addr));
 		}
-		if(strchr(buffer ,'\n') != NULL){
-			syslog(LOG_DEBUG, "Newline found, breaking. Full message: %s", buffer);
-			break;
+
+		pthread_mutex_lock(&pool->mutex);
+	}
+	pthread_mutex_unlock(&pool->mutex);
+
+	return worker_data;
+}
+
+/*
+ * Stops the workers and closes the connections still waiting in the queue.
+ * Connections being served are shut down so workers blocked on them return.
+ */
+static void pool_stop(struct worker_pool* pool){
+	pthread_mutex_lock(&pool->mutex);
+	pool->stopping = true;
+	for (int i = 0; i < pool->started; i++){
+		if (pool->workers[i].sockfd_in >= 0){
+			shutdown(pool->workers[i].sockfd_in, SHUT_RDWR);
 		}
+	}
+	pthread_cond_broadcast(&pool->work);
+	pthread_mutex_unlock(&pool->mutex);
 
-		buffer_size += bytes_received;
-		buffer = realloc(buffer, buffer_size);
+	for (int i = 0; i < pool->started; i++){
+		pthread_join(pool->workers[i].thread, NULL);
 	}
+	pool->started = 0;
 
-	FILE* file = fopen(FILENAME, "r+");
-	if (file == NULL){
-		syslog(LOG_ERR, "Error opening file for read/write: %s\n", strerror(errno));
-		thread_args->thread_complete = true;
-		thread_args->thread_complete_success = false;
-		return conn_data;
+	while (pool->queue_len > 0){
+		close(pool->queue[pool->queue_head].sockfd_in);
+		pool->queue_head = (pool->queue_head + 1) % pool->limit;
+		pool->queue_len--;
+		pool->inflight--;
 	}
+}
 
-	rc = pthread_mutex_lock(thread_args->mutex); 
-	if (rc != 0){
-		syslog(LOG_ERR, "Mutex lock failed to lock with %d", rc);
-		thread_args->thread_complete = true;
-		thread_args->thread_complete_success = false;
-		return conn_data;
+static void pool_destroy(struct worker_pool* pool){
+	if (pool->slotfd >= 0){
+		close(pool->slotfd);
+	}
+	pthread_cond_destroy(&pool->work);
+	pthread_mutex_destroy(&pool->mutex);
+	free(pool->queue);
+	free(pool->workers);
+}
+
+static int pool_start(struct worker_pool* pool, int nworkers, int limit, pthread_mutex_t* file_mutex){
+	memset(pool, 0, sizeof(*pool));
+	pthread_mutex_init(&pool->mutex, NULL);
+	pthread_cond_init(&pool->work, NULL);
+	pool->file_mutex = file_mutex;
+	pool->nworkers = nworkers;
+	pool->limit = limit;
+
+	pool->slotfd = eventfd(0, EFD_CLOEXEC);
+	if (pool->slotfd < 0){
+		syslog(LOG_ERR, "Error creating pool eventfd: %s\n", strerror(errno));
+		return -1;
 	}
 
-	if (strncmp(buffer, "AESDCHAR_IOCSEEKTO:", strlen("AESDCHAR_IOCSEEKTO:")) == 0) {
-		syslog(LOG_DEBUG, "IOCTL received %s", buffer);
-		unsigned int write_cmd, write_cmd_offset;
-		if (sscanf(buffer, "AESDCHAR_IOCSEEKTO:%u,%u", &write_cmd, &write_cmd_offset) == 2) {
-			struct aesd_seekto seekto;
-			seekto.write_cmd = write_cmd;
-			seekto.write_cmd_offset = write_cmd_offset;
+	pool->workers = calloc(nworkers, sizeof(struct pool_worker));
+	pool->queue = calloc(limit, sizeof(struct conn_work));
+	if (pool->workers == NULL || pool->queue == NULL){
+		syslog(LOG_ERR, "Error allocating pool of %d workers\n", nworkers);
+		return -1;
+	}
 
-			ioctl(fileno(file), AESDCHAR_IOCSEEKTO, &seekto);
+	for (int i = 0; i < nworkers; i++){
+		pool->workers[i].pool = pool;
+		pool->workers[i].sockfd_in = -1;
+		int rc = pthread_create(&pool->workers[i].thread, NULL, pool_worker_thread, &pool->workers[i]);
+		if (rc != 0){
+			syslog(LOG_ERR, "Failed to create worker thread %d", rc);
+			return -1;
 		}
-	} else {
-		syslog(LOG_DEBUG, "Writing to file %s", buffer);
-		if (fwrite(buffer, sizeof(char), total_bytes, file) < 0){
-			syslog(LOG_ERR, "Error writing to file: %s\n", strerror(errno));
-			thread_args->thread_complete = true;
-			thread_args->thread_complete_success = false;
-			return conn_data;
+		pool->started++;
+	}
+
+	return 0;
+}
+
+/*
+ * Queues an accepted connection for the workers. Returns -1 when limit
+ * connections are already admitted.
+ */
+static int pool_admit(struct worker_pool* pool, int sockfd_in, struct sockaddr_in* addr_client){
+	pthread_mutex_lock(&pool->mutex);
+	if (pool->inflight >= pool->limit){
+		pool->shed++;
+		pthread_mutex_unlock(&pool->mutex);
+		return -1;
+	}
+
+	int slot = (pool->queue_head + pool->queue_len) % pool->limit;
+	pool->queue[slot].sockfd_in = sockfd_in;
+	pool->queue[slot].addr_client = *addr_client;
+	pool->queue[slot].queued_ms = committer_now_ms();
+	pool->queue_len++;
+	pool->inflight++;
+	pool->admitted++;
+	if (pool->queue_len > pool->queue_max){
+		pool->queue_max = pool->queue_len;
+	}
+	pthread_cond_signal(&pool->work);
+	pthread_mutex_unlock(&pool->mutex);
+
+	return 0;
+}
+
+/*
+ * Blocks until fewer than limit connections are admitted, leaving new ones
+ * in the listen backlog meanwhile. Returns -1 when a signal interrupted it.
+ */
+static int pool_wait_slot(struct worker_pool* pool){
+	pthread_mutex_lock(&pool->mutex);
+	if (pool->inflight >= pool->limit && !pool->paused){
+		pool->pauses++;
+	}
+	while (pool->inflight >= pool->limit){
+		pool->paused = true;
+		pthread_mutex_unlock(&pool->mutex);
+
+		struct pollfd pfd = { .fd = pool->slotfd, .events = POLLIN };
+		if (poll(&pfd, 1, -1) < 0){
+			if (errno != EINTR){
+				syslog(LOG_ERR, "poll: %s\n", strerror(errno));
+			}
+			return -1;
 		}
+		eventfd_t value;
+		eventfd_read(pool->slotfd, &value);
 
-		fsync(fileno(file));
-		rewind(file);
+		pthread_mutex_lock(&pool->mutex);
 	}
+	pthread_mutex_unlock(&pool->mutex);
 
-	rc = pthread_mutex_unlock(thread_args->mutex);
-	if (rc != 0){
-		syslog(LOG_ERR, "Mutex unlock failed to unlock with %d", rc);
-		thread_args->thread_complete = true;
-		thread_args->thread_complete_success = false;
-		return conn_data;
+	return 0;
+}
+
+static void log_pool_stats(struct worker_pool* pool){
+	pthread_mutex_lock(&pool->mutex);
+	syslog(LOG_INFO, "Pool: %d/%d workers busy, %d queued (max %d), %d/%d admitted, "
+		"%lu accepts, %lu shed, %lu pauses, queue wait avg %lld ms max %lld ms\n",
+		pool->busy, pool->nworkers, pool->queue_len, pool->queue_max,
+		pool->inflight, pool->limit, pool->admitted, pool->shed, pool->pauses,
+		(pool->dequeued > 0) ? pool->wait_total_ms / (long long)pool->dequeued : 0,
+		pool->wait_max_ms);
+	pthread_mutex_unlock(&pool->mutex);
+}
+
+/*
+ * Classic mode: accepted connections are served by a fixed pool of worker
+ * threads. SIGUSR1 logs the pool counters, which show how deep the queue
+ * gets and how long connections wait in it.
+ */
+static int serve_threads(int sockfd){
+	int retval = 0;
+	struct worker_pool pool;
+
+	if (pool_start(&pool, config.nworkers, config.max_conns, &lock) != 0){
+		pool_stop(&pool);
+		pool_destroy(&pool);
+		return -1;
 	}
 
-	char buff[1024] = { 0 };
-	int bytes_read;
-	while((bytes_read = fread(buff, sizeof(char), sizeof(buff), file)) > 0){
-		syslog(LOG_DEBUG, "Rading from file: %s", buff);
-		if (send(thread_args->sockfd_in, buff, bytes_read, 0) < 0){
-			syslog(LOG_ERR, "Error sending data: %s\n", strerror(errno));
-			thread_args->thread_complete = true;
-			thread_args->thread_complete_success = false;
-			return conn_data;
+    while (!signal_caught){
+		if (stats_requested){
+			stats_requested = false;
+			log_pool_stats(&pool);
+		}
+		if (config.overload == OVERLOAD_PAUSE && pool_wait_slot(&pool) != 0){
+			continue;
+		}
+
+        int sockfd_in; 
+        struct sockaddr_in addr_client;
+        socklen_t sockaddr_client_len = sizeof(addr_client);
+
+        if ((sockfd_in = accept(sockfd, (struct sockaddr*) &addr_client, &sockaddr_client_len)) < 0){
+			if (errno == EINTR || errno == ECONNABORTED){
+				continue;
+			}
+			syslog(LOG_ERR, "accept: %s\n", strerror(errno));
+			retval = -1;
+		    break;
+        }
+
+        syslog(LOG_INFO, "Accepted connection from %s\n", inet_ntoa(addr_client.sin_addr));
+
+		if (pool_admit(&pool, sockfd_in, &addr_client) != 0){
+			syslog(LOG_DEBUG, "Overloaded, shedding connection from %s\n", inet_ntoa(addr_client.sin_addr));
+			close(sockfd_in);
+		}
+    }
+
+	pool_stop(&pool);
+	log_pool_stats(&pool);
+	pool_destroy(&pool);
+
+	return retval;
+}
+
+static void usage(const char* progname){
+	fprintf(stderr,
+		"Usage: %s [-d] [-m thread|epoll|reuseport|uring] [-n workers] [-p] [-b backlog]\n"
+		"          [-s policy] [-i ms] [-k] [-c mutex|queue] [-l limit] [-o pause|shed]\n"
+		"          [-D devices]\n"
+		"  -d            run as a daemon\n"
+		"  -m mode       thread: pool of worker threads serving a connection each (default)\n"
+		"                epoll: single epoll reactor thread\n"
+		"                reuseport: one reactor and SO_REUSEPORT listener per worker\n"
+		"                uring: io_uring reactors, falls back to epoll if unavailable\n"
+		"  -n workers    number of thread mode workers (default: %d), reuseport reactors\n"
+		"                (default: online cpus) or uring reactors (default: 1)\n"
+		"  -p            pin each reactor to a cpu\n"
+		"  -b backlog    listen backlog (default: %d)\n"
+		"  -s policy     durability: per-request (default), group, interval, none\n"
+		"  -i ms         sync interval of the interval policy (default: %d)\n"
+		"  -k            keep-alive: reply to every packet in order and keep the\n"
+		"                connection open until the client closes it\n"
+		"  -c mode       append serialization: mutex (default) or queue, a lock-free\n"
+		"                queue drained by one writer thread\n"
+		"  -l limit      thread mode: connections admitted at once, served or waiting\n"
+		"                for a worker (default: %d per worker)\n"
+		"  -o policy     thread mode overload: pause accepting (default) or shed\n"
+		"                connections past the limit\n"
+		"  -D devices    spread connections round robin over this many aesdchar\n"
+		"                devices, %s then %s1 and on (default: 1); not with\n"
+		"                uring mode, group durability or queue concurrency. Offsets of\n"
+		"                AESDSOCKET_READFROM and AESDSOCKET_TAIL name no byte of the next\n"
+		"                connection's device, so those are refused\n",
+		progname, DEFAULT_POOL_WORKERS, DEFAULT_BACKLOG, DEFAULT_FLUSH_INTERVAL_MS,
+		POOL_LIMIT_PER_WORKER, FILENAME, FILENAME);
+}
+
+static void parse_options(int argc, char* argv[]){
+	int c;
+	while ((c = getopt(argc, argv, "dm:n:pb:s:i:kc:l:o:D:")) != -1){
+		switch (c){
+			case 'd':
+				config.rundaemon = true;
+				break;
+			case 'm':
+				if (strcmp(optarg, "thread") == 0){
+					config.mode = SERVER_MODE_THREAD;
+				} else if (strcmp(optarg, "epoll") == 0){
+					config.mode = SERVER_MODE_EPOLL;
+				} else if (strcmp(optarg, "reuseport") == 0){
+					config.mode = SERVER_MODE_REUSEPORT;
+				} else if (strcmp(optarg, "uring") == 0){
+					config.mode = SERVER_MODE_URING;
+				} else {
+					fprintf(stderr, "Unknown mode %s\n", optarg);
+					usage(argv[0]);
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case 'n':
+				config.nworkers = atoi(optarg);
+				if (config.nworkers <= 0 || config.nworkers > MAX_REACTORS){
+					fprintf(stderr, "Invalid number of workers %s\n", optarg);
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case 'p':
+				config.pin_cpus = true;
+				break;
+			case 'b':
+				config.backlog = atoi(optarg);
+				if (config.backlog <= 0){
+					fprintf(stderr, "Invalid backlog %s\n", optarg);
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case 's':
+				if (strcmp(optarg, "per-request") == 0){
+					config.durability = DURABILITY_PER_REQUEST;
+				} else if (strcmp(optarg, "group") == 0){
+					config.durability = DURABILITY_GROUP;
+				} else if (strcmp(optarg, "interval") == 0){
+					config.durability = DURABILITY_INTERVAL;
+				} else if (strcmp(optarg, "none") == 0){
+					config.durability = DURABILITY_NONE;
+				} else {
+					fprintf(stderr, "Unknown durability policy %s\n", optarg);
+					usage(argv[0]);
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case 'i':
+				config.flush_interval_ms = atoi(optarg);
+				if (config.flush_interval_ms <= 0){
+					fprintf(stderr, "Invalid sync interval %s\n", optarg);
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case 'k':
+				config.keepalive = true;
+				break;
+			case 'c':
+				if (strcmp(optarg, "mutex") == 0){
+					config.concurrency = CONCURRENCY_MUTEX;
+				} else if (strcmp(optarg, "queue") == 0){
+					config.concurrency = CONCURRENCY_QUEUE;
+				} else {
+					fprintf(stderr, "Unknown concurrency mode %s\n", optarg);
+					usage(argv[0]);
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case 'l':
+				config.max_conns = atoi(optarg);
+				if (config.max_conns <= 0){
+					fprintf(stderr, "Invalid connection limit %s\n", optarg);
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case 'o':
+				if (strcmp(optarg, "pause") == 0){
+					config.overload = OVERLOAD_PAUSE;
+				} else if (strcmp(optarg, "shed") == 0){
+					config.overload = OVERLOAD_SHED;
+				} else {
+					fprintf(stderr, "Unknown overload policy %s\n", optarg);
+					usage(argv[0]);
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case 'D':
+				config.shards = atoi(optarg);
+				if (config.shards <= 0 || config.shards > MAX_SHARDS){
+					fprintf(stderr, "Invalid number of devices %s\n", optarg);
+					exit(EXIT_FAILURE);
+				}
+				break;
+			default:
+				usage(argv[0]);
+				exit(EXIT_FAILURE);
 		}
 	}
-	if (fclose(file) == EOF){
-		syslog(LOG_ERR, "Error closing the file: %s\n", strerror(errno));
-		thread_args->thread_complete = true;
-		thread_args->thread_complete_success = false;
-		return conn_data;
+
+	/*
+	 * The committer and the io_uring reactors append through one file descriptor.
+	 * READFROM and TAIL offsets are per device, process_readfrom() refuses them.
+	 */
+	if (config.shards > 1 && (USE_AESD_CHAR_DEVICE == 0 || config.mode == SERVER_MODE_URING ||
+		config.durability == DURABILITY_GROUP || config.concurrency == CONCURRENCY_QUEUE)){
+		fprintf(stderr, "Several devices need the aesdchar device and no uring mode, group durability or queue concurrency\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (config.mode == SERVER_MODE_THREAD){
+		if (config.nworkers == 0){
+			config.nworkers = DEFAULT_POOL_WORKERS;
+		}
+		if (config.max_conns == 0){
+			config.max_conns = config.nworkers * POOL_LIMIT_PER_WORKER;
+		}
+	} else if (config.mode == SERVER_MODE_EPOLL){
+		config.nworkers = 1;
+	} else if (config.mode == SERVER_MODE_URING && config.nworkers == 0){
+		config.nworkers = 1;
+	} else if (config.nworkers == 0){
+		long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+		config.nworkers = (ncpus > 0) ? ncpus : 1;
 	}
+}
 
-	close(thread_args->sockfd_in);
-	syslog(LOG_INFO, "Closed connection from %s\n", inet_ntoa(thread_args->addr_client.sin_addr));
+/*
+ * Creates a socket bound to the server address. SO_REUSEPORT lets every
+ * reuseport reactor bind its own listener to the same port.
+ */
+static int open_listener(struct addrinfo* servinfo){
+	int sockfd, opt = 1;
 
-	free(buffer);
+	if ((sockfd = socket(servinfo->ai_family, servinfo->ai_socktype, servinfo->ai_protocol)) < 0){
+		syslog(LOG_ERR, "Error opening socket: %s\n", strerror(errno));
+		return -1;
+	}
 
-	thread_args->thread_complete = true;
-	thread_args->thread_complete_success = true;
+	if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0 ||
+		setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0) {
+		syslog(LOG_ERR, "setsockopt: %s\n", strerror(errno));
+		close(sockfd);
+		return -1;
+	}
+
+	if (bind(sockfd, servinfo->ai_addr, servinfo->ai_addrlen) < 0){
+		syslog(LOG_ERR, "bind: %s\n", strerror(errno));
+		close(sockfd);
+		return -1;
+	}
 
-    return conn_data;
+	return sockfd;
 }
 
-int main(int argc, char const* argv[]){
-    int sockfd, status, opt = 1;
+int main(int argc, char* argv[]){
+    int status;
     struct addrinfo hints;
     struct addrinfo* servinfo;
-    bool rundaemon = false;
-
-	SLIST_HEAD(list_head, conn_thread) threads_head;
-	SLIST_INIT(&threads_head);
 
     if (pthread_mutex_init(&lock, NULL) < 0) { 
 		syslog(LOG_ERR, "Error initializing mutex: %s\n", strerror(errno));
@@ -238,9 +3601,14 @@ int main(int argc, char const* argv[]){
 
     struct sigaction new_action = {.sa_handler = signal_handler};
 
-    if (argc > 1 && strcmp(argv[1], "-d") == 0){
-        rundaemon = true;
-    }
+	parse_options(argc, argv);
+
+	for (int i = 0; i < config.shards; i++){
+		if (pthread_mutex_init(&shard_table.mutex[i], NULL) != 0){
+			syslog(LOG_ERR, "Error initializing mutex of device %d\n", i);
+			exit(EXIT_FAILURE);
+		}
+	}
 
     if (sigaction(SIGTERM, &new_action, NULL) != 0){
 		syslog(LOG_ERR, "Error registering SIGTERM handler: %s\n", strerror(errno));
@@ -250,6 +3618,10 @@ int main(int argc, char const* argv[]){
 		syslog(LOG_ERR, "Error registering SIGINT handler: %s\n", strerror(errno));
         exit(EXIT_FAILURE);
     }
+    if (sigaction(SIGUSR1, &new_action, NULL) != 0){
+		syslog(LOG_ERR, "Error registering SIGUSR1 handler: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
 
     openlog("assignment5", LOG_CONS | LOG_NDELAY | LOG_PERROR, LOG_USER);
 
@@ -263,29 +3635,29 @@ int main(int argc, char const* argv[]){
         exit(EXIT_FAILURE);
     }
 
-    if ((sockfd = socket(servinfo->ai_family, servinfo->ai_socktype, servinfo->ai_protocol)) < 0){
-		syslog(LOG_ERR, "Error opening socket: %s\n", strerror(errno));
+	/* thread mode workers share a single listener */
+	int nlisteners = (config.mode == SERVER_MODE_THREAD) ? 1 : config.nworkers;
+	int* listeners = calloc(nlisteners, sizeof(int));
+	if (listeners == NULL){
+		syslog(LOG_ERR, "Error allocating %d listeners\n", nlisteners);
 		exit(EXIT_FAILURE);
-    }
-
-    if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR | SO_REUSEPORT, &opt, sizeof(opt)) < 0) {
-		syslog(LOG_ERR, "setsockopt: %s\n", strerror(errno));
-        exit(EXIT_FAILURE);
-    }
-
-    if (bind(sockfd, servinfo->ai_addr, servinfo->ai_addrlen) < 0){
-		syslog(LOG_ERR, "bind: %s\n", strerror(errno));
-        exit(EXIT_FAILURE);
-    }
+	}
+	for (int i = 0; i < nlisteners; i++){
+		if ((listeners[i] = open_listener(servinfo)) < 0){
+			exit(EXIT_FAILURE);
+		}
+	}
 
-    if (rundaemon){
+    if (config.rundaemon){
         daemon(0, 0);
     }
 
-    if (listen(sockfd, 5) < 0){
-		syslog(LOG_ERR, "listen: %s\n", strerror(errno));
-		exit(EXIT_FAILURE);
-    }
+	for (int i = 0; i < nlisteners; i++){
+		if (listen(listeners[i], config.backlog) < 0){
+			syslog(LOG_ERR, "listen: %s\n", strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+	}
 
 	#if (USE_AESD_CHAR_DEVICE == 0)
 	struct timer_thread_data timer_data = {
@@ -317,63 +3689,36 @@ int main(int argc, char const* argv[]){
 	}
 	#endif
 
-    while (!signal_caught){
-        int sockfd_in; 
-        struct sockaddr_in addr_client;
-        socklen_t sockaddr_client_len = sizeof(addr_client);
-
-        if ((sockfd_in = accept(sockfd, (struct sockaddr*) &addr_client, &sockaddr_client_len)) < 0){
-			syslog(LOG_ERR, "accept: %s\n", strerror(errno));
-		    break;
-        }
-
-		struct conn_thread* finished_threads[64] = { NULL };
-		struct conn_thread* tmp_thread;
-		int thread_index = 0;
-		SLIST_FOREACH(tmp_thread, &threads_head, entries){
-			if(tmp_thread->thread_data.thread_complete){
-				finished_threads[thread_index++] = tmp_thread;
-			}
-		}
-		for (int i = 0; i < thread_index; i++){
-			pthread_join(finished_threads[i]->thread, NULL);
-			SLIST_REMOVE(&threads_head, finished_threads[i], conn_thread, entries);
-			free(finished_threads[i]);
-		}
-
-        syslog(LOG_INFO, "Accepted connection from %s\n", inet_ntoa(addr_client.sin_addr));
-
-		struct conn_thread_data data = {
-			.mutex = &lock,
-			.sockfd_in = sockfd_in,
-			.addr_client = addr_client,
-			.thread_complete = false,
-			.thread_complete_success = true
-		};
+	if (committer_start() != 0){
+		exit(EXIT_FAILURE);
+	}
 
-		struct conn_thread* new_thread = malloc(sizeof(struct conn_thread));
-		new_thread->thread_data = data;
-		int rc = pthread_create(&new_thread->thread, NULL, handle_conn, &new_thread->thread_data);
-		if (rc != 0){
-			syslog(LOG_ERR, "Failed to create a thread %d", rc);
-			new_thread->thread_data.thread_complete_success = false;
+	int rc = 0;
+	switch (config.mode){
+		case SERVER_MODE_EPOLL:
+		case SERVER_MODE_REUSEPORT:
+		case SERVER_MODE_URING:
+			rc = run_reactors(listeners, config.nworkers, config.pin_cpus);
+			break;
+		default:
+			rc = serve_threads(listeners[0]);
 			break;
-		}
-		SLIST_INSERT_HEAD(&threads_head, new_thread, entries);
-    }
-
-	while (!SLIST_EMPTY(&threads_head)){
-		struct conn_thread* tmp = SLIST_FIRST(&threads_head);
-		pthread_join(tmp->thread, NULL);
-		SLIST_REMOVE_HEAD(&threads_head, entries);
-		free(tmp);
 	}
 
 	#if (USE_AESD_CHAR_DEVICE == 0)
 	timer_delete(timer);
 	#endif
+
+	committer_stop();
     pthread_mutex_destroy(&lock);
-    close(sockfd);
+	for (int i = 0; i < config.shards; i++){
+		pthread_mutex_destroy(&shard_table.mutex[i]);
+	}
+	recv_buffer_drain_pool();
+	for (int i = 0; i < nlisteners; i++){
+		close(listeners[i]);
+	}
+	free(listeners);
     freeaddrinfo(servinfo);
     closelog();
 
@@ -381,5 +3726,5 @@ int main(int argc, char const* argv[]){
 	remove(FILENAME);
 	#endif
 
-    return 0;
+    return (rc == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
 }
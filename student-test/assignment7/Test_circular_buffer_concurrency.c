@@ -0,0 +1,273 @@
+#define _GNU_SOURCE
+#include "unity.h"
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "../../aesd-char-driver/aesd-circular-buffer.h"
+#include "mirror-ring.h"
+
+/**
+* Models the lockless history reads of the aesdchar driver in user space: one writer packs entries
+* into a mirrored byte ring under a sequence count while readers look up spans in a snapshot of the
+* descriptors, copy them, and re-check after a read fence that the bytes were not evicted and
+* overwritten meanwhile. Every span a reader keeps must match the stream of all bytes ever added.
+*/
+
+#define CONC_RING_SIZE 4096
+#define CONC_CAPACITY 64
+#define CONC_MAX_SPAN 512
+#define CONC_MAX_READERS 4
+
+/**
+* The history shared by the writer and the readers, with the sequence count standing in for the
+* seqcount_mutex_t of the driver
+*/
+struct conc_history {
+    struct aesd_circular_buffer buffer;
+    atomic_uint seq;
+    atomic_bool done;
+};
+
+struct conc_reader {
+    pthread_t thread;
+    struct conc_history *history;
+    size_t bytes;
+    size_t spans;
+    size_t evicted;
+    size_t torn;
+};
+
+static char stream_byte(size_t stream_offset)
+{
+    return (char)(stream_offset * 131 + (stream_offset >> 9));
+}
+
+static void write_begin(struct conc_history *history)
+{
+    atomic_store_explicit(&history->seq, atomic_load_explicit(&history->seq, memory_order_relaxed) + 1,
+            memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+}
+
+static void write_end(struct conc_history *history)
+{
+    atomic_store_explicit(&history->seq, atomic_load_explicit(&history->seq, memory_order_relaxed) + 1,
+            memory_order_release);
+}
+
+static unsigned int read_begin(struct conc_history *history)
+{
+    unsigned int seq;
+
+    while ((seq = atomic_load_explicit(&history->seq, memory_order_acquire)) & 1);
+    return seq;
+}
+
+static bool read_retry(struct conc_history *history, unsigned int seq)
+{
+    atomic_thread_fence(memory_order_acquire);
+    return atomic_load_explicit(&history->seq, memory_order_relaxed) != seq;
+}
+
+static size_t stream_start(struct aesd_circular_buffer *buffer)
+{
+    return buffer->end_offs - aesd_circular_buffer_size(buffer);
+}
+
+/**
+* The re-check of aesd_span_evicted(), after the fence standing in for its smp_rmb()
+* @return true if the oldest byte kept moved past stream offset @param at
+*/
+static bool span_evicted(struct conc_history *history, size_t at)
+{
+    size_t start_now;
+    unsigned int seq;
+
+    atomic_thread_fence(memory_order_acquire);
+    do {
+        seq = read_begin(history);
+        start_now = stream_start(&history->buffer);
+    } while (read_retry(history, seq));
+    return start_now > at;
+}
+
+static void setup_history(struct conc_history *history, char **ring)
+{
+    *ring = mirror_ring_map(CONC_RING_SIZE);
+    TEST_ASSERT_NOT_NULL_MESSAGE(*ring, "could not map the ring twice");
+    TEST_ASSERT_EQUAL_INT(0, aesd_circular_buffer_init_capacity(&history->buffer, CONC_CAPACITY));
+    TEST_ASSERT_EQUAL_INT(0, aesd_circular_buffer_init_ring(&history->buffer, *ring, CONC_RING_SIZE));
+    atomic_store(&history->seq, 0);
+    atomic_store(&history->done, false);
+}
+
+/**
+* Publishes @param count entries the way aesd_publish_entry() does: evictions for the room are
+* published before the bytes are copied into the ring, the entry after.
+*/
+static void write_entries(struct conc_history *history, size_t count)
+{
+    struct aesd_circular_buffer *buffer = &history->buffer;
+
+    for (size_t i = 0; i < count; i++) {
+        size_t size = (i * 37) % 300 + 1;
+        char *ptr;
+
+        write_begin(history);
+        ptr = aesd_circular_buffer_ring_reserve(buffer, size);
+        write_end(history);
+        for (size_t j = 0; j < size; j++) {
+            ptr[j] = stream_byte(buffer->end_offs + j);
+        }
+        write_begin(history);
+        aesd_circular_buffer_add_entry(buffer, &(struct aesd_buffer_entry){ ptr, size });
+        write_end(history);
+        if (i % 32 == 31) {
+            /* let readers in on a single CPU too, about every two turns of the ring */
+            sched_yield();
+        }
+    }
+}
+
+/**
+* Follows the history like a tailing aesd_read(): looks up the span at pos in a snapshot, copies it,
+* and keeps it only if the oldest byte kept has not moved past it by the time the copy is done.
+*/
+static void *reader_thread(void *arg)
+{
+    struct conc_reader *reader = arg;
+    struct conc_history *history = reader->history;
+    char copy[CONC_MAX_SPAN];
+    size_t pos = 0, lookups = 0;
+
+    while (!atomic_load_explicit(&history->done, memory_order_acquire)) {
+        const char *span;
+        size_t oldest, at, len = 0;
+        unsigned int seq;
+
+        do {
+            seq = read_begin(history);
+            oldest = stream_start(&history->buffer);
+            at = (pos < oldest) ? oldest : pos;
+            span = aesd_circular_buffer_span_for_fpos(&history->buffer, at - oldest, CONC_MAX_SPAN, &len);
+        } while (read_retry(history, seq));
+        if (span == NULL) {
+            /* caught up, where aesd_read would wait for the next write */
+            sched_yield();
+            continue;
+        }
+        if (++lookups % 4 == 0) {
+            /* copy_to_user() may fault and sleep, leaving the writer time to lap the reader */
+            sched_yield();
+        }
+        memcpy(copy, span, len);
+        if (span_evicted(history, at)) {
+            reader->evicted++;
+            continue;
+        }
+
+        for (size_t i = 0; i < len; i++) {
+            if (copy[i] != stream_byte(at + i)) {
+                reader->torn++;
+                break;
+            }
+        }
+        reader->bytes += len;
+        reader->spans++;
+        pos = at + len;
+    }
+    return reader;
+}
+
+static double elapsed_s(const struct timespec *start, const struct timespec *end)
+{
+    return (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/**
+* Runs the writer against @param readers readers over a ring small enough that readers are lapped.
+* Prints what the readers kept and their throughput together.
+*/
+static void run_readers(size_t readers, size_t entries)
+{
+    static struct conc_history history;
+    struct conc_reader reader[CONC_MAX_READERS];
+    struct timespec start, end;
+    size_t bytes = 0, spans = 0, evicted = 0, torn = 0;
+    char message[128];
+    char *ring;
+
+    setup_history(&history, &ring);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (size_t r = 0; r < readers; r++) {
+        reader[r] = (struct conc_reader){ .history = &history };
+        TEST_ASSERT_EQUAL_INT(0, pthread_create(&reader[r].thread, NULL, reader_thread, &reader[r]));
+    }
+    write_entries(&history, entries);
+    atomic_store_explicit(&history.done, true, memory_order_release);
+    for (size_t r = 0; r < readers; r++) {
+        pthread_join(reader[r].thread, NULL);
+        bytes += reader[r].bytes;
+        spans += reader[r].spans;
+        evicted += reader[r].evicted;
+        torn += reader[r].torn;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    printf("%zu readers: %zu spans, %zu bytes kept, %zu spans evicted while copied, %zu torn, %.0f MB/s\n",
+            readers, spans, bytes, evicted, torn, bytes / elapsed_s(&start, &end) / 1e6);
+    snprintf(message, sizeof(message), "%zu readers kept %zu torn spans", readers, torn);
+    TEST_ASSERT_EQUAL_UINT_MESSAGE(0, torn, message);
+    aesd_circular_buffer_free(&history.buffer);
+    mirror_ring_unmap(ring, CONC_RING_SIZE);
+}
+
+/**
+* Interleaves by hand what the readers race for: the writer laps the ring between the lookup of a
+* span and its copy, so the copy reads other bytes and only the re-check tells.
+*/
+void test_recheck_catches_span_overwritten_during_copy()
+{
+    static struct conc_history history;
+    char copy[CONC_MAX_SPAN], expected[CONC_MAX_SPAN];
+    const char *span;
+    size_t len = 0;
+    char *ring;
+
+    setup_history(&history, &ring);
+    write_entries(&history, 10);
+    span = aesd_circular_buffer_span_for_fpos(&history.buffer, 0, CONC_MAX_SPAN, &len);
+    TEST_ASSERT_NOT_NULL(span);
+    TEST_ASSERT_FALSE(span_evicted(&history, 0));
+
+    write_entries(&history, 40);
+    memcpy(copy, span, len);
+    for (size_t i = 0; i < len; i++) {
+        expected[i] = stream_byte(i);
+    }
+    TEST_ASSERT_TRUE_MESSAGE(memcmp(copy, expected, len) != 0, "the span was not overwritten");
+    TEST_ASSERT_TRUE(span_evicted(&history, 0));
+    aesd_circular_buffer_free(&history.buffer);
+    mirror_ring_unmap(ring, CONC_RING_SIZE);
+}
+
+void test_concurrent_span_reads_never_keep_overwritten_bytes()
+{
+    run_readers(2, 200000);
+}
+
+/**
+* Prints how the read throughput scales with the number of readers, which never block the writer
+* or each other.
+*/
+void test_concurrent_span_reads_scaling()
+{
+    for (size_t readers = 1; readers <= CONC_MAX_READERS; readers *= 2) {
+        run_readers(readers, 100000);
+    }
+}
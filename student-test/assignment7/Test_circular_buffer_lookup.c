@@ -0,0 +1,170 @@
+#include "unity.h"
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "../../aesd-char-driver/aesd-circular-buffer.h"
+
+/**
+* Checks aesd_circular_buffer_find_entry_offset_for_fpos(), a binary search over the entry start
+* offsets, against a linear scan of the entries from out_offs, the way the lookup used to work.
+* Entries are added past capacity and evicted by max_bytes, so the oldest entry sits anywhere in
+* the entry array and the searched range wraps around its end.
+*/
+
+#define LOOKUP_POOL_SIZE 4096
+
+static char lookup_pool[LOOKUP_POOL_SIZE];
+
+static struct aesd_buffer_entry *linear_find(struct aesd_circular_buffer *buffer, size_t char_offset,
+        size_t *entry_offset_byte_rtn)
+{
+    size_t count = aesd_circular_buffer_count(buffer);
+    size_t index = buffer->out_offs;
+
+    for (size_t i = 0; i < count; i++) {
+        struct aesd_buffer_entry *entry = &buffer->entry[index];
+        if (char_offset < entry->size) {
+            *entry_offset_byte_rtn = char_offset;
+            return entry;
+        }
+        char_offset -= entry->size;
+        index = (index + 1) % buffer->capacity;
+    }
+    return NULL;
+}
+
+/**
+* Sizes cycle through 0 to 12 bytes, so some entries are empty and the binary search has to skip them.
+*/
+static void add_entries(struct aesd_circular_buffer *buffer, size_t first, size_t count)
+{
+    for (size_t i = first; i < first + count; i++) {
+        struct aesd_buffer_entry entry = {
+            .buffptr = lookup_pool + (i * 13) % (LOOKUP_POOL_SIZE - 16),
+            .size = i % 13
+        };
+        while (aesd_circular_buffer_make_room(buffer, entry.size) != NULL);
+        aesd_circular_buffer_add_entry(buffer, &entry);
+    }
+}
+
+static size_t linear_size(struct aesd_circular_buffer *buffer)
+{
+    size_t count = aesd_circular_buffer_count(buffer);
+    size_t size = 0;
+
+    for (size_t i = 0; i < count; i++) {
+        size += buffer->entry[(buffer->out_offs + i) % buffer->capacity].size;
+    }
+    return size;
+}
+
+static void check_every_offset(struct aesd_circular_buffer *buffer)
+{
+    size_t size = linear_size(buffer);
+    char message[128];
+
+    TEST_ASSERT_EQUAL_UINT_MESSAGE(size, aesd_circular_buffer_size(buffer), "size differs from the sum of entry sizes");
+    for (size_t offset = 0; offset <= size + 2; offset++) {
+        size_t expected_offset = 0, entry_offset = 0;
+        struct aesd_buffer_entry *expected = linear_find(buffer, offset, &expected_offset);
+        struct aesd_buffer_entry *entry = aesd_circular_buffer_find_entry_offset_for_fpos(buffer, offset, &entry_offset);
+
+        snprintf(message, sizeof(message), "offset %zu of %zu, out_offs %zu, capacity %zu",
+                offset, size, buffer->out_offs, buffer->capacity);
+        TEST_ASSERT_EQUAL_PTR_MESSAGE(expected, entry, message);
+        if (expected != NULL) {
+            TEST_ASSERT_EQUAL_UINT_MESSAGE(expected_offset, entry_offset, message);
+        }
+    }
+}
+
+void test_lookup_across_wrap_matches_linear_scan()
+{
+    const size_t capacities[] = { 1, 2, 3, 10, 64 };
+
+    for (size_t c = 0; c < sizeof(capacities) / sizeof(capacities[0]); c++) {
+        struct aesd_circular_buffer buffer;
+        size_t capacity = capacities[c];
+
+        TEST_ASSERT_EQUAL_INT(0, aesd_circular_buffer_init_capacity(&buffer, capacity));
+        check_every_offset(&buffer);
+        /* one entry at a time up to several times around the entry array */
+        for (size_t added = 0; added < capacity * 4 + 3; added++) {
+            add_entries(&buffer, added, 1);
+            check_every_offset(&buffer);
+        }
+        aesd_circular_buffer_free(&buffer);
+    }
+}
+
+void test_lookup_after_byte_bound_evictions_matches_linear_scan()
+{
+    const size_t max_bytes[] = { 1, 12, 25, 100 };
+
+    for (size_t m = 0; m < sizeof(max_bytes) / sizeof(max_bytes[0]); m++) {
+        struct aesd_circular_buffer buffer;
+
+        TEST_ASSERT_EQUAL_INT(0, aesd_circular_buffer_init_capacity(&buffer, 16));
+        buffer.max_bytes = max_bytes[m];
+        /* evictions by size leave the buffer not full with out_offs anywhere */
+        for (size_t added = 0; added < 100; added++) {
+            add_entries(&buffer, added * 7, 1);
+            check_every_offset(&buffer);
+        }
+        aesd_circular_buffer_free(&buffer);
+    }
+}
+
+static double elapsed_ns(const struct timespec *start, const struct timespec *end)
+{
+    return (end->tv_sec - start->tv_sec) * 1e9 + (end->tv_nsec - start->tv_nsec);
+}
+
+/**
+* Times lookups of pseudo random offsets with the binary search and with the linear scan, for entry
+* counts up to where the difference matters. Prints the cost per lookup; only the results are asserted.
+*/
+void test_lookup_benchmark_against_linear_scan()
+{
+    const size_t capacities[] = { 10, 100, 1000, 10000 };
+    const size_t lookups = 20000;
+
+    for (size_t c = 0; c < sizeof(capacities) / sizeof(capacities[0]); c++) {
+        struct aesd_circular_buffer buffer;
+        struct timespec start, end;
+        size_t capacity = capacities[c];
+        size_t size, entry_offset, seed;
+        uintptr_t checksum[2] = { 0, 0 };
+        double ns[2];
+
+        TEST_ASSERT_EQUAL_INT(0, aesd_circular_buffer_init_capacity(&buffer, capacity));
+        /* wrap around once so the oldest entry is in the middle of the entry array */
+        add_entries(&buffer, 0, capacity + capacity / 2);
+        size = aesd_circular_buffer_size(&buffer);
+
+        seed = 1;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (size_t i = 0; i < lookups; i++) {
+            seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+            checksum[0] += (uintptr_t)aesd_circular_buffer_find_entry_offset_for_fpos(&buffer, (seed >> 20) % size, &entry_offset) + entry_offset;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        ns[0] = elapsed_ns(&start, &end) / lookups;
+
+        seed = 1;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (size_t i = 0; i < lookups; i++) {
+            seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+            checksum[1] += (uintptr_t)linear_find(&buffer, (seed >> 20) % size, &entry_offset) + entry_offset;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        ns[1] = elapsed_ns(&start, &end) / lookups;
+
+        printf("lookup among %zu entries (%zu bytes): binary search %.1f ns, linear scan %.1f ns\n",
+                capacity, size, ns[0], ns[1]);
+        TEST_ASSERT_EQUAL_UINT_MESSAGE(checksum[1], checksum[0], "binary search and linear scan disagree");
+        aesd_circular_buffer_free(&buffer);
+    }
+}
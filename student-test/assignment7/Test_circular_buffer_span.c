@@ -0,0 +1,196 @@
+#define _GNU_SOURCE
+#include "unity.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "../../aesd-char-driver/aesd-circular-buffer.h"
+#include "mirror-ring.h"
+
+/**
+* Checks aesd_circular_buffer_span_for_fpos() on a byte ring mapped twice in a row the way the driver
+* maps it, so entries written at the end of the ring run into the mirror and spans cross the end of
+* the ring. Every byte read through a span is compared with the stream of all bytes ever added.
+*/
+
+#define SPAN_RING_SIZE 4096
+#define SPAN_CAPACITY 64
+
+/**
+* @return the byte at @param stream_offset of the stream of all bytes added, a pattern that does not
+* repeat with the ring size so a span at the wrong place in the ring reads wrong bytes
+*/
+static char stream_byte(size_t stream_offset)
+{
+    return (char)(stream_offset * 131 + (stream_offset >> 9));
+}
+
+/**
+* Adds an entry of @param size bytes the way the driver publishes one: reserve room in the ring,
+* copy the bytes there, possibly into the mirror, and add the entry.
+*/
+static void add_ring_entry(struct aesd_circular_buffer *buffer, size_t size)
+{
+    char *ptr = aesd_circular_buffer_ring_reserve(buffer, size);
+
+    TEST_ASSERT_NOT_NULL(ptr);
+    for (size_t i = 0; i < size; i++) {
+        ptr[i] = stream_byte(buffer->end_offs + i);
+    }
+    aesd_circular_buffer_add_entry(buffer, &(struct aesd_buffer_entry){ ptr, size });
+}
+
+static void setup_ring(struct aesd_circular_buffer *buffer, char **ring, size_t capacity)
+{
+    *ring = mirror_ring_map(SPAN_RING_SIZE);
+    TEST_ASSERT_NOT_NULL_MESSAGE(*ring, "could not map the ring twice");
+    TEST_ASSERT_EQUAL_INT(0, aesd_circular_buffer_init_capacity(buffer, capacity));
+    TEST_ASSERT_EQUAL_INT(0, aesd_circular_buffer_init_ring(buffer, *ring, SPAN_RING_SIZE));
+}
+
+/**
+* Reads the whole buffer in spans of at most @param max_len bytes from every starting offset, checking
+* each span against the stream.
+* @return the number of spans that crossed the end of the ring
+*/
+static size_t check_spans(struct aesd_circular_buffer *buffer, size_t max_len)
+{
+    size_t size = aesd_circular_buffer_size(buffer);
+    size_t oldest = buffer->end_offs - size;
+    size_t crossed = 0;
+    char message[128];
+
+    for (size_t offset = 0; offset < size; offset++) {
+        size_t len = 0;
+        const char *span = aesd_circular_buffer_span_for_fpos(buffer, offset, max_len, &len);
+
+        snprintf(message, sizeof(message), "offset %zu of %zu, max_len %zu, ring_head %zu",
+                offset, size, max_len, buffer->ring_head);
+        TEST_ASSERT_NOT_NULL_MESSAGE(span, message);
+        TEST_ASSERT_TRUE_MESSAGE(len > 0 && len <= max_len && offset + len <= size, message);
+        TEST_ASSERT_TRUE_MESSAGE(span >= buffer->ring && span + len <= buffer->ring + 2 * SPAN_RING_SIZE, message);
+        for (size_t i = 0; i < len; i++) {
+            TEST_ASSERT_EQUAL_INT8_MESSAGE(stream_byte(oldest + offset + i), span[i], message);
+        }
+        if (span < buffer->ring + SPAN_RING_SIZE && span + len > buffer->ring + SPAN_RING_SIZE) {
+            crossed++;
+        }
+    }
+    TEST_ASSERT_NULL(aesd_circular_buffer_span_for_fpos(buffer, size, max_len, &(size_t){ 0 }));
+    return crossed;
+}
+
+void test_span_reads_across_ring_end_match_stream()
+{
+    const size_t max_lens[] = { 1, 7, 300, SPAN_RING_SIZE };
+    struct aesd_circular_buffer buffer;
+    size_t crossed = 0;
+    char *ring;
+
+    setup_ring(&buffer, &ring, SPAN_CAPACITY);
+    /* sizes of 1 to 300 bytes go several times around the ring, entries end anywhere in it */
+    for (size_t i = 0; i < 80; i++) {
+        add_ring_entry(&buffer, (i * 37) % 300 + 1);
+        if (i % 8 == 7) {
+            for (size_t m = 0; m < sizeof(max_lens) / sizeof(max_lens[0]); m++) {
+                crossed += check_spans(&buffer, max_lens[m]);
+            }
+        }
+    }
+    TEST_ASSERT_TRUE_MESSAGE(crossed > 0, "no span crossed the end of the ring");
+    aesd_circular_buffer_free(&buffer);
+    mirror_ring_unmap(ring, SPAN_RING_SIZE);
+}
+
+void test_span_returns_whole_history_at_once()
+{
+    struct aesd_circular_buffer buffer;
+    size_t len = 0;
+    const char *span;
+    char *ring;
+
+    setup_ring(&buffer, &ring, SPAN_CAPACITY);
+    for (size_t i = 0; i < 200; i++) {
+        add_ring_entry(&buffer, (i * 53) % 400 + 1);
+        /* entries are back to back in the ring, so from the oldest byte one span covers all of them */
+        span = aesd_circular_buffer_span_for_fpos(&buffer, 0, SIZE_MAX, &len);
+        TEST_ASSERT_NOT_NULL(span);
+        TEST_ASSERT_EQUAL_UINT(aesd_circular_buffer_size(&buffer), len);
+    }
+    /* after several turns of 1 to 400 byte entries the history runs over the end of the ring */
+    TEST_ASSERT_TRUE(span + len > ring + SPAN_RING_SIZE);
+    for (size_t i = 0; i < len; i++) {
+        TEST_ASSERT_EQUAL_INT8(stream_byte(buffer.end_offs - len + i), span[i]);
+    }
+    aesd_circular_buffer_free(&buffer);
+    mirror_ring_unmap(ring, SPAN_RING_SIZE);
+}
+
+static double elapsed_ns(const struct timespec *start, const struct timespec *end)
+{
+    return (end->tv_sec - start->tv_sec) * 1e9 + (end->tv_nsec - start->tv_nsec);
+}
+
+/**
+* Times copying the whole history out by spans, as aesd_read does, and one entry per lookup, as it did
+* before spans, for several entry sizes. Each span or entry stands for one copy_to_user() call. Prints
+* the copies per pass and the throughput; only the copied bytes are asserted.
+*/
+void test_span_benchmark_against_entry_lookups()
+{
+    const size_t entry_sizes[] = { 16, 64, 256 };
+    const size_t passes = 2000;
+    static char out[SPAN_RING_SIZE];
+
+    for (size_t s = 0; s < sizeof(entry_sizes) / sizeof(entry_sizes[0]); s++) {
+        struct aesd_circular_buffer buffer;
+        struct timespec start, end;
+        size_t size, len, entry_offset, copies[2] = { 0, 0 };
+        double ns[2];
+        char *ring;
+
+        /* enough entries to fill the ring, a turn and a half so the history crosses its end */
+        setup_ring(&buffer, &ring, SPAN_RING_SIZE / entry_sizes[s]);
+        for (size_t added = 0; added < SPAN_RING_SIZE * 3 / 2; added += entry_sizes[s]) {
+            add_ring_entry(&buffer, entry_sizes[s]);
+        }
+        size = aesd_circular_buffer_size(&buffer);
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (size_t pass = 0; pass < passes; pass++) {
+            for (size_t offset = 0; offset < size; offset += len) {
+                const char *span = aesd_circular_buffer_span_for_fpos(&buffer, offset, size - offset, &len);
+                memcpy(out + offset, span, len);
+                copies[0]++;
+            }
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        ns[0] = elapsed_ns(&start, &end);
+        for (size_t i = 0; i < size; i++) {
+            TEST_ASSERT_EQUAL_INT8(stream_byte(buffer.end_offs - size + i), out[i]);
+        }
+
+        memset(out, 0, sizeof(out));
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (size_t pass = 0; pass < passes; pass++) {
+            for (size_t offset = 0; offset < size; offset += len) {
+                struct aesd_buffer_entry *entry = aesd_circular_buffer_find_entry_offset_for_fpos(&buffer, offset, &entry_offset);
+                len = entry->size - entry_offset;
+                memcpy(out + offset, entry->buffptr + entry_offset, len);
+                copies[1]++;
+            }
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        ns[1] = elapsed_ns(&start, &end);
+        for (size_t i = 0; i < size; i++) {
+            TEST_ASSERT_EQUAL_INT8(stream_byte(buffer.end_offs - size + i), out[i]);
+        }
+
+        printf("%zu entries of %zu bytes: spans %zu copies/pass %.0f MB/s, entry lookups %zu copies/pass %.0f MB/s\n",
+                aesd_circular_buffer_count(&buffer), entry_sizes[s],
+                copies[0] / passes, size * passes * 1e3 / ns[0],
+                copies[1] / passes, size * passes * 1e3 / ns[1]);
+        aesd_circular_buffer_free(&buffer);
+        mirror_ring_unmap(ring, SPAN_RING_SIZE);
+    }
+}
@@ -0,0 +1,47 @@
+#ifndef STUDENT_TEST_MIRROR_RING_H
+#define STUDENT_TEST_MIRROR_RING_H
+
+/**
+* Userspace stand-in for the byte ring of the aesdchar driver, which vmaps its ring pages twice in a
+* row: the same memory file is mapped at ring and at ring + size, so bytes written past the end of the
+* ring land at its start and a span running over the end reads linearly.
+* Include after defining _GNU_SOURCE, for memfd_create().
+*/
+
+#include <stddef.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+/**
+* @param size bytes of the ring, a multiple of the page size
+* @return the ring followed by its mirror, or NULL on failure
+*/
+static inline char *mirror_ring_map(size_t size)
+{
+    char *ring = NULL;
+    int fd = memfd_create("aesd-ring", 0);
+
+    if (fd < 0) {
+        return NULL;
+    }
+    if (ftruncate(fd, size) == 0) {
+        /* reserve both halves at once, then map the file over each of them */
+        ring = mmap(NULL, 2 * size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (ring == MAP_FAILED) {
+            ring = NULL;
+        } else if (mmap(ring, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED ||
+                mmap(ring + size, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) {
+            munmap(ring, 2 * size);
+            ring = NULL;
+        }
+    }
+    close(fd);
+    return ring;
+}
+
+static inline void mirror_ring_unmap(char *ring, size_t size)
+{
+    munmap(ring, 2 * size);
+}
+
+#endif